@@ -0,0 +1,174 @@
+#ifndef _BATCH_INSTALL_HANDLER_H_
+#define _BATCH_INSTALL_HANDLER_H_
+
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <thread>
+#include <limits.h>
+
+#include "common.h"
+#include "install_handler.h"
+
+// installs a list of vpks back to back over one connection.
+// all archives are indexed in parallel up front, the next one is read ahead (and recompressed with
+// --deflate) while the current one uploads and the device promotes it. an archive of the title being
+// installed waits for that install, its install manifest (the patch base) is only read afterwards
+class BatchInstallHandler : public PacketHandler {
+public:
+    ~BatchInstallHandler() {
+        for(auto ih : handlers)
+            delete ih;
+    }
+
+    // one vpk path per line, empty lines and lines starting with # are skipped.
+    // a vpk listed twice is installed once, its two index workers would share one cache file
+    bool Load(const std::string& manifest_file) {
+        std::ifstream f(manifest_file);
+        if(!f)
+            return false;
+        std::string line;
+        std::set<std::string> seen;
+        while(std::getline(f, line)) {
+            while(!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t'))
+                line.pop_back();
+            size_t start = line.find_first_not_of(" \t");
+            if(start == std::string::npos || line[start] == '#')
+                continue;
+            std::string path = line.substr(start);
+            char real_path[PATH_MAX];
+            if(!seen.insert(realpath(path.c_str(), real_path) ? std::string(real_path) : path).second) {
+                std::cout << "local vpk " << path << " listed twice, skipped." << std::endl;
+                continue;
+            }
+            vpk_files.push_back(path);
+        }
+        if(vpk_files.empty())
+            return false;
+        handlers.resize(vpk_files.size(), nullptr);
+        prepared.resize(vpk_files.size(), false);
+        std::atomic<size_t> next_vpk(0);
+        auto index_fun = [this, &next_vpk]() {
+            for(size_t idx = next_vpk++; idx < vpk_files.size(); idx = next_vpk++) {
+                auto ih = new InstallHandler();
+                if(ih->Load(vpk_files[idx]))
+                    handlers[idx] = ih;
+                else
+                    delete ih;
+            }
+        };
+        size_t thread_count = std::thread::hardware_concurrency();
+        if(thread_count < 1)
+            thread_count = 1;
+        if(thread_count > vpk_files.size())
+            thread_count = vpk_files.size();
+        std::vector<std::thread> workers;
+        for(size_t i = 0; i < thread_count; ++i)
+            workers.emplace_back(index_fun);
+        for(auto& th : workers)
+            th.join();
+        size_t loaded = 0;
+        for(size_t i = 0; i < handlers.size(); ++i) {
+            if(handlers[i])
+                loaded++;
+            else
+                std::cout << "local vpk " << vpk_files[i] << " load fail, skipped." << std::endl;
+        }
+        return loaded != 0;
+    }
+
+    void SetOptions(const std::string& dev, bool patch, bool pipeline, int32_t level, bool stream_cache, bool headers_first) {
+        for(auto ih : handlers) {
+            if(!ih)
+                continue;
+            ih->EnablePipeline(pipeline);
+            ih->EnableHeadersFirst(headers_first);
+        }
+        device = dev;
+        patch_mode = patch;
+        deflate_level = level;
+        stream_cache_mode = stream_cache;
+        // the first archive warms up while connecting
+        Prepare(NextLoaded(0));
+    }
+
+    int32_t InitSend(Sender& s) {
+        batch_begin = std::chrono::steady_clock::now();
+        current = NextLoaded(0);
+        return StartCurrent(s);
+    }
+
+    int32_t HandlePacket(Sender& s, short type, void* data, int32_t length) {
+        if(current >= handlers.size())
+            return 1;
+        if(!handlers[current]->HandlePacket(s, type, data, length))
+            return 0;
+        // this install is over, on success or not, the device is ready for the next one
+        // unless the stream broke off mid packet
+        bool broken = handlers[current]->Broken();
+        if(handlers[current]->Succeeded())
+            installed++;
+        else
+            failed++;
+        delete handlers[current];
+        handlers[current] = nullptr;
+        current = NextLoaded(current + 1);
+        if(broken && current < handlers.size())
+            std::cout << "batch: connection broken, remaining vpks not installed." << std::endl;
+        if(broken || current >= handlers.size()) {
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - batch_begin).count();
+            std::cout << "batch: " << installed << " installed, " << failed << " failed, "
+                << vpk_files.size() - installed - failed << " skipped in " << elapsed << " s." << std::endl;
+            return 1;
+        }
+        return StartCurrent(s);
+    }
+
+protected:
+    size_t NextLoaded(size_t idx) {
+        while(idx < handlers.size() && !handlers[idx])
+            idx++;
+        return idx;
+    }
+
+    void Prepare(size_t idx) {
+        if(idx >= handlers.size() || prepared[idx])
+            return;
+        // the install in flight rewrites the manifest of its title
+        if(current < handlers.size() && current != idx && handlers[current]
+            && !handlers[idx]->TitleId().empty() && handlers[idx]->TitleId() == handlers[current]->TitleId())
+            return;
+        prepared[idx] = true;
+        handlers[idx]->SetDevice(device, patch_mode);
+        if(stream_cache_mode && handlers[idx]->EnableStreamCache(deflate_level)) {
+            handlers[idx]->Prefetch();
+            return;
+        }
+        handlers[idx]->Prefetch();
+        if(deflate_level > 0)
+            handlers[idx]->EnableDeflate(std::thread::hardware_concurrency(), deflate_level);
+    }
+
+    int32_t StartCurrent(Sender& s) {
+        std::cout << "[" << current + 1 << "/" << vpk_files.size() << "] " << vpk_files[current]
+            << " (" << handlers[current]->TitleId() << ")" << std::endl;
+        Prepare(current);
+        // the next archive warms up while this one is sent and promoted
+        Prepare(NextLoaded(current + 1));
+        return handlers[current]->InitSend(s);
+    }
+
+    std::vector<std::string> vpk_files;
+    std::vector<InstallHandler*> handlers;
+    std::vector<bool> prepared;
+    std::string device;
+    bool patch_mode = false;
+    size_t current = 0;
+    size_t installed = 0;
+    size_t failed = 0;
+    int32_t deflate_level = 0;
+    bool stream_cache_mode = false;
+    std::chrono::steady_clock::time_point batch_begin;
+};
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <sys/mman.h>
+
+#include "common.h"
+
+// process wide source of chunk buffers, send buffers and coroutine stacks.
+// buffers are mapped in page (or huge page) granularity and kept for reuse,
+// everything mapped stays below the --max-memory cap: an acquire that does not fit
+// waits for a release, unless nothing is in use at all so a lone caller always progresses
+class BufferPool {
+public:
+    static BufferPool& Shared() {
+        static BufferPool pool;
+        return pool;
+    }
+
+    ~BufferPool() {
+        for(auto& iter : free_buffers)
+            munmap(iter.second, iter.first);
+    }
+
+    void SetLimit(size_t bytes) {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        limit = bytes;
+    }
+
+    size_t Limit() {
+        return limit;
+    }
+
+    void EnableHugePages(bool on) {
+        huge_pages = on;
+    }
+
+    void* Acquire(size_t size) {
+        size_t got = 0;
+        return Acquire(size, size, got);
+    }
+
+    // the largest buffer between min_size and size that fits, the granted size is returned in got.
+    // without wait nullptr is returned instead of waiting for a release
+    void* Acquire(size_t size, size_t min_size, size_t& got, bool wait = true) {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        size = RoundSize(size);
+        min_size = RoundSize(min_size);
+        while(true) {
+            auto iter = free_buffers.lower_bound(min_size);
+            if(iter != free_buffers.end() && iter->first <= size) {
+                // reuse the biggest cached buffer in range
+                auto best = free_buffers.upper_bound(size);
+                --best;
+                got = best->first;
+                void* ptr = best->second;
+                free_buffers.erase(best);
+                cached -= got;
+                in_use += got;
+                return ptr;
+            }
+            size_t avail = Available();
+            if(avail < size && cached) {
+                Trim(size - avail);
+                avail = Available();
+            }
+            if(avail >= min_size || in_use == 0) {
+                got = (avail >= size || in_use == 0) ? size : RoundDown(avail);
+                void* ptr = Map(got);
+                if(ptr) {
+                    mapped += got;
+                    in_use += got;
+                    if(mapped > peak)
+                        peak = mapped;
+                    return ptr;
+                }
+                if(in_use == 0)
+                    return nullptr;
+            }
+            if(!wait)
+                return nullptr;
+            pool_cond.wait(lock);
+        }
+    }
+
+    void Release(void* ptr, size_t size) {
+        if(!ptr)
+            return;
+        {
+            std::unique_lock<std::mutex> lock(pool_mutex);
+            size = RoundSize(size);
+            in_use -= size;
+            free_buffers.insert(std::make_pair(size, ptr));
+            cached += size;
+            if(limit && mapped > limit)
+                Trim(mapped - limit);
+        }
+        pool_cond.notify_all();
+    }
+
+    size_t Peak() {
+        return peak;
+    }
+
+protected:
+    size_t Available() {
+        if(!limit)
+            return (size_t)-1;
+        return mapped >= limit ? 0 : limit - mapped;
+    }
+
+    size_t RoundSize(size_t size) {
+        size_t unit = (huge_pages && size >= huge_page_size) ? huge_page_size : 4096;
+        return (size + unit - 1) / unit * unit;
+    }
+
+    size_t RoundDown(size_t size) {
+        size_t unit = (huge_pages && size >= huge_page_size) ? huge_page_size : 4096;
+        return size / unit * unit;
+    }
+
+    void* Map(size_t size) {
+        void* ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if(huge_pages && size % huge_page_size == 0)
+            ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if(ptr == MAP_FAILED) {
+            ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(ptr == MAP_FAILED)
+                return nullptr;
+#ifdef MADV_HUGEPAGE
+            // no reserved huge pages, let transparent huge pages back it
+            if(huge_pages && size >= huge_page_size)
+                madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+        }
+        return ptr;
+    }
+
+    // unmap cached buffers, smallest first, until bytes are returned
+    void Trim(size_t bytes) {
+        size_t freed = 0;
+        for(auto iter = free_buffers.begin(); iter != free_buffers.end() && freed < bytes;) {
+            munmap(iter->second, iter->first);
+            freed += iter->first;
+            cached -= iter->first;
+            mapped -= iter->first;
+            iter = free_buffers.erase(iter);
+        }
+    }
+
+    static const size_t huge_page_size = 2 * 1024 * 1024;
+    std::mutex pool_mutex;
+    std::condition_variable pool_cond;
+    std::multimap<size_t, void*> free_buffers;
+    size_t limit = 0;
+    size_t mapped = 0;
+    size_t in_use = 0;
+    size_t cached = 0;
+    size_t peak = 0;
+    bool huge_pages = false;
+};
+
+#endif
@@ -1,15 +1,19 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <cstdint>
 #include <unordered_map>
 #include <vector>
 #include <string.h>
+#include <stdlib.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
@@ -17,12 +21,39 @@ class Sender {
 public:
     virtual ~Sender() {}
     virtual size_t Send(void* data, size_t sz) = 0;
+    // gathered write of a batch of packets, zerocopy only when the data stays untouched until the next ack
+    virtual size_t SendV(const iovec* iov, int32_t count, bool zerocopy = false) {
+        size_t sent = 0;
+        for(int32_t i = 0; i < count; ++i)
+            sent += Send(iov[i].iov_base, iov[i].iov_len);
+        return sent;
+    }
+    // window/ack hooks for transport tuning
+    virtual void BeginWindow() {}
+    virtual void EndWindow(size_t bytes) {}
+    virtual void WindowAcked() {}
+    virtual void WindowReleased() {}
+    // bytes to send before the next pause, fallback when the sender does not size windows
+    virtual size_t WindowSize(size_t fallback) { return fallback; }
+    // length bytes of a file at offset, already framed, the default reads them through Send
+    virtual size_t SendFile(int32_t fd, uint64_t offset, size_t length) {
+        std::vector<uint8_t> buf(length < 0x10000 ? length : 0x10000);
+        size_t sent = 0;
+        while(sent < length) {
+            ssize_t len = pread(fd, buf.data(), std::min(buf.size(), length - sent), offset + sent);
+            if(len <= 0 || Send(buf.data(), len) != (size_t)len)
+                break;
+            sent += len;
+        }
+        return sent;
+    }
 };
 
 class PacketHandler {
 public:
     virtual ~PacketHandler() {}
-    virtual void InitSend(Sender& s) = 0;
+    // sends the first request, non-zero when the handler is already done (nothing could be sent)
+    virtual int32_t InitSend(Sender& s) = 0;
     virtual int32_t HandlePacket(Sender& s, short type, void* data, int32_t length) = 0;
 };
 
@@ -31,55 +62,262 @@ struct pkt_base {
     short type;
 };
 
-struct VTP_BEGIN_FILE {
-    pkt_base hdr = {8, 0x10};
-    uint32_t size;
-    uint32_t flag;
-};
+// uploads are read in chunks of this size, a multiple of 1024 (one content packet).
+// windows are cut to whole chunks so each pause ends one
+const size_t upload_chunk_size = 64 * 1024;
 
-struct VTP_FILE_CONTENT {
-    pkt_base hdr = {4, 0x11};
-    uint8_t buf[1024];
-};
+// the wire is little endian like the device, other hosts swap on the way in and out
+template<typename T>
+inline T wire_order(T val) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    T res;
+    for(size_t i = 0; i < sizeof(T); ++i)
+        ((uint8_t*)&res)[i] = ((const uint8_t*)&val)[sizeof(T) - 1 - i];
+    return res;
+#else
+    return val;
+#endif
+}
 
-struct VTP_FILE_END {
-    pkt_base hdr = {4, 0x12};
-};
+inline pkt_base wire_header(short length, short type) {
+    pkt_base hdr = {wire_order(length), wire_order(type)};
+    return hdr;
+}
+
+inline pkt_base read_header(const void* data) {
+    pkt_base hdr;
+    memcpy(&hdr, data, 4);
+    return wire_header(hdr.length, hdr.type);
+}
 
-struct VTP_DOWN_FILE {
-    pkt_base hdr = {4, 0x13};
+template<typename... FIELDS>
+struct FieldsSize {
+    static const size_t value = 0;
 };
 
-struct VTP_DOWN_CONTINE {
-    pkt_base hdr = {4, 0x14};
+template<typename FIRST, typename... REST>
+struct FieldsSize<FIRST, REST...> {
+    static const size_t value = sizeof(FIRST) + FieldsSize<REST...>::value;
 };
 
-struct VTP_INSTALL_VPK {
-    pkt_base hdr = {16, 0x20};
-    uint32_t total_size_l = 0;
-    uint32_t total_size_h = 0;
-    uint32_t flag = 0;
+template<size_t IDX, typename... FIELDS>
+struct FieldAt;
+
+template<typename FIRST, typename... REST>
+struct FieldAt<0, FIRST, REST...> {
+    typedef FIRST type;
+    static const size_t offset = 0;
 };
 
-struct VTP_VPK_CONTENT {
-    pkt_base hdr = {4, 0x21};
+template<size_t IDX, typename FIRST, typename... REST>
+struct FieldAt<IDX, FIRST, REST...> {
+    typedef typename FieldAt<IDX - 1, REST...>::type type;
+    static const size_t offset = sizeof(FIRST) + FieldAt<IDX - 1, REST...>::offset;
 };
 
-struct VTP_INSTALL_VPK_END {
-    pkt_base hdr = {4, 0x22};
+// schema of one packet: its type and fixed fields, a variable tail (path, records, content) may follow.
+// the length is derived from the layout, header, fields and tail leave in one write
+template<short TYPE, typename... FIELDS>
+struct Packet {
+    static const short type = TYPE;
+    static const size_t fixed_size = 4 + FieldsSize<FIELDS...>::value;
+    // nothing longer is accepted by the receive loops
+    static const size_t max_size = 1500;
+
+    // header and fixed fields, returns the bytes written
+    static size_t Encode(uint8_t* dst, size_t tail_size, FIELDS... fields) {
+        pkt_base hdr = wire_header((short)(fixed_size + tail_size), TYPE);
+        memcpy(dst, &hdr, 4);
+        size_t pos = 4;
+        int unpack[] = {0, (Put(dst, pos, fields), 0)...};
+        (void)unpack;
+        return pos;
+    }
+
+    static size_t Send(Sender& s, FIELDS... fields) {
+        uint8_t buf[fixed_size];
+        Encode(buf, 0, fields...);
+        return s.Send(buf, fixed_size);
+    }
+
+    static bool Fits(size_t tail_size) {
+        return fixed_size + tail_size <= max_size;
+    }
+
+    // a packet over max_size is not sent, the caller has to fail instead of waiting for a reply
+    static size_t SendTail(Sender& s, const void* tail, size_t tail_size, FIELDS... fields) {
+        uint8_t buf[max_size];
+        if(!Fits(tail_size)) {
+            std::cout << "packet 0x" << std::hex << TYPE << std::dec << " too long (" << fixed_size + tail_size << " bytes), not sent." << std::endl;
+            return 0;
+        }
+        Encode(buf, tail_size, fields...);
+        if(tail_size)
+            memcpy(&buf[fixed_size], tail, tail_size);
+        return s.Send(buf, fixed_size + tail_size);
+    }
+
+    static size_t SendTail(Sender& s, const std::string& str, FIELDS... fields) {
+        return SendTail(s, str.c_str(), str.length() + 1, fields...);
+    }
+
+    // header for packets gathered into an iovec, the tail stays where it is
+    static pkt_base Header(size_t tail_size) {
+        static_assert(sizeof...(FIELDS) == 0, "gathered packets carry no fixed fields");
+        return wire_header((short)(fixed_size + tail_size), TYPE);
+    }
+
+    // zero copy view of a received packet body (the data after the header)
+    class View {
+    public:
+        View(const void* data, int32_t length) : body((const uint8_t*)data), body_size(length) {}
+
+        bool Valid() const {
+            return body_size >= (int32_t)(fixed_size - 4);
+        }
+
+        // fields past the end of a short packet read as 0, so optional trailing fields need no special case
+        template<size_t IDX>
+        typename FieldAt<IDX, FIELDS...>::type Get() const {
+            typedef typename FieldAt<IDX, FIELDS...>::type field_type;
+            field_type val = 0;
+            size_t off = FieldAt<IDX, FIELDS...>::offset;
+            if(off + sizeof(field_type) <= (size_t)body_size)
+                memcpy(&val, &body[off], sizeof(field_type));
+            return wire_order(val);
+        }
+
+        const uint8_t* Tail() const {
+            return Valid() ? &body[fixed_size - 4] : nullptr;
+        }
+
+        int32_t TailSize() const {
+            return Valid() ? body_size - (int32_t)(fixed_size - 4) : 0;
+        }
+
+    protected:
+        const uint8_t* body;
+        int32_t body_size;
+    };
+
+protected:
+    template<typename T>
+    static void Put(uint8_t* dst, size_t& pos, T val) {
+        val = wire_order(val);
+        memcpy(&dst[pos], &val, sizeof(T));
+        pos += sizeof(T);
+    }
 };
 
-struct VTRP_RES {
-    short length = 8;
-    short type = 0;
-    int result = 0;
+// client -> device, VTRP_ are the device replies of the same type
+// flag 0x2 appends the high word of the size after the path terminator, older devices stop at the
+// terminator and never see it. a device supporting it sends the high word of the offset as third field
+typedef Packet<0x10, uint32_t, uint32_t> VTP_BEGIN_FILE;    // size_l, flag 0x1, 0x2-64 bit + path [+ size_h]
+typedef Packet<0x10, int32_t, uint32_t, uint32_t> VTRP_BEGIN_FILE;     // result, offset_l to resume from [, offset_h]
+typedef Packet<0x11> VTP_FILE_CONTENT;                      // up to 1024 bytes, empty is the pause/ack
+typedef Packet<0x12> VTP_FILE_END;
+typedef Packet<0x12, int32_t> VTRP_FILE_END;                // result
+typedef Packet<0x13> VTP_DOWN_FILE;                         // + path
+typedef Packet<0x13, int32_t, uint32_t> VTRP_DOWN_FILE;     // result, size
+typedef Packet<0x14> VTP_DOWN_CONTINE;                      // device content, empty is the pause/ack
+typedef Packet<0x15> VTP_DOWN_END;
+typedef Packet<0x30, uint32_t> VTP_LIST_DIR;                // flag 0x1-recursive + path
+typedef Packet<0x30, int32_t> VTRP_LIST_DIR;                // result
+typedef Packet<0x31> VTP_LIST_CONTENT;                      // VTP_LIST_ENTRY records
+typedef Packet<0x32> VTP_LIST_END;
+
+// removes a file or a whole directory tree, used by sync for extras
+typedef Packet<0x40> VTP_REMOVE_PATH;                       // + path
+typedef Packet<0x40, int32_t> VTRP_REMOVE_PATH;             // result
+
+// records are streamed back to back through VTP_LIST_CONTENT packets and may span packets
+// name is relative to the listed directory and not null-terminated, fields are little endian
+struct VTP_LIST_ENTRY {
+    uint16_t name_size;
+    uint16_t attr;      // 0x1-directory
+    uint32_t size_l;
+    uint32_t size_h;
+    uint32_t mtime;
 };
 
-inline void send_resp(Sender& s, short type, int result) {
-    VTRP_RES res;
-    res.type = type;
-    res.result = result;
-    s.Send(&res, 8);
+// flag 0x10 asks for a patch install over the installed title, a device supporting it
+// echoes the accepted flags after the result in its 0x20 reply
+// in a patch install an entry with csize -1 removes the installed file
+// flag 0x20 announces entries deflated by the client, marked by bit 15 of their nlen
+// flag 0x40 announces eboot.bin and sce_sys/ first, a device accepting it checks them as they
+// arrive and may answer 0x23 mid-stream, after which the client sends nothing more of that install
+typedef Packet<0x20, uint32_t, uint32_t, uint32_t> VTP_INSTALL_VPK;    // total_size_l, total_size_h, flag 0x8-system app, 0x10-patch, 0x20-recompressed entries, 0x40-headers first
+typedef Packet<0x20, int32_t, uint32_t> VTRP_INSTALL_VPK;               // result, accepted flags
+typedef Packet<0x21> VTP_VPK_CONTENT;                                   // entry record stream, empty is the device ack
+typedef Packet<0x14> VTP_VPK_PAUSE;
+typedef Packet<0x22> VTP_INSTALL_VPK_END;
+typedef Packet<0x22, int32_t> VTRP_INSTALL_VPK_END;                     // result
+typedef Packet<0x23, int32_t> VTRP_INSTALL_VPK_ABORT;                   // result, as for 0x22
+
+// "64M", "512K", "1G" or plain bytes
+inline size_t parse_size(const char* str) {
+    char* end = nullptr;
+    double val = strtod(str, &end);
+    if(end && (*end == 'k' || *end == 'K'))
+        val *= 1024.0;
+    else if(end && (*end == 'm' || *end == 'M'))
+        val *= 1024.0 * 1024.0;
+    else if(end && (*end == 'g' || *end == 'G'))
+        val *= 1024.0 * 1024.0 * 1024.0;
+    return val > 0.0 ? (size_t)val : 0;
+}
+
+// modification time in nanoseconds, seconds alone miss a same-size rewrite within a second
+inline int64_t stat_mtime_ns(const struct stat& st) {
+#ifdef __APPLE__
+    return (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+// TITLE_ID of a param.sfo, empty when it is not one
+inline std::string sfo_title_id(const std::vector<uint8_t>& sfo) {
+    if(sfo.size() < 20 || memcmp(sfo.data(), "\0PSF", 4) != 0)
+        return "";
+    uint32_t key_table = *(const uint32_t*)&sfo[8];
+    uint32_t data_table = *(const uint32_t*)&sfo[12];
+    uint32_t count = *(const uint32_t*)&sfo[16];
+    for(uint32_t i = 0; i < count && 20 + i * 16 + 16 <= sfo.size(); ++i) {
+        const uint8_t* ent = &sfo[20 + i * 16];
+        uint32_t key_pos = key_table + *(const uint16_t*)ent;
+        uint32_t data_len = *(const uint32_t*)(ent + 4);
+        uint32_t data_pos = data_table + *(const uint32_t*)(ent + 12);
+        if(key_pos >= sfo.size() || data_pos + data_len > sfo.size())
+            continue;
+        if(strncmp((const char*)&sfo[key_pos], "TITLE_ID", sfo.size() - key_pos) == 0)
+            return std::string((const char*)&sfo[data_pos], strnlen((const char*)&sfo[data_pos], data_len));
+    }
+    return "";
+}
+
+// local cache files live in ~/.vitamgr
+inline std::string cache_path(const std::string& name) {
+    const char* home = getenv("HOME");
+    std::string dir = home ? std::string(home) + "/.vitamgr" : std::string(".vitamgr");
+    mkdir(dir.c_str(), 0755);
+    return dir + "/" + name;
+}
+
+// length prefixed strings used by the cache files
+inline std::string read_string(std::istream& f) {
+    uint16_t len = 0;
+    f.read((char*)&len, 2);
+    std::string str(len, '\0');
+    if(len)
+        f.read(&str[0], len);
+    return str;
+}
+
+inline void write_string(std::ostream& f, const std::string& str) {
+    uint16_t len = str.length();
+    f.write((const char*)&len, 2);
+    f.write(str.c_str(), len);
 }
 
 #endif
@@ -1,14 +1,23 @@
 #ifndef _COPY_HANDLER_H_
 #define _COPY_HANDLER_H_
 
+#include <fcntl.h>
+
 #include "common.h"
 #include "cotiny.hh"
+#include "buffer_pool.h"
+#include "send_pipeline.h"
+#include "timeline.h"
 
 class CopyHandler : public PacketHandler {
 public:
     ~CopyHandler() {
+        if(pipeline)
+            delete pipeline;
         if(send_routine)
             delete send_routine;
+        BufferPool::Shared().Release(send_stack, 0x10000);
+        BufferPool::Shared().Release(chunk_buffer, upload_chunk_size);
     }
     
     bool Load(const std::string& src_file, const std::string& remote_path) {
@@ -17,49 +26,107 @@ public:
             return false;
         file.seekg(0, file.end);
         file_size = file.tellg();
+        // path, its terminator and the high half of the size
+        if(!VTP_BEGIN_FILE::Fits(remote_path.length() + 5)) {
+            std::cout << "remote path " << remote_path << " is too long." << std::endl;
+            return false;
+        }
         vita_path = remote_path;
+        local_path = src_file;
         return true;
     }
+
+    // warm the page cache while an earlier transfer is still running
+    void Prefetch() {
+#ifdef POSIX_FADV_WILLNEED
+        int32_t fd = open(local_path.c_str(), O_RDONLY);
+        if(fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+#endif
+    }
+
+    bool Succeeded() {
+        return succeeded;
+    }
     
-    void SendAll(Sender& s, int32_t offset) {
-        static const int32_t send_threshold = 2 * 1024 * 1024;
+    size_t ReadChunk(uint8_t* dst, size_t size) {
+        TimelineSpan span("read", "io", size);
+        file.read((char*)dst, size);
+        return file.gcount();
+    }
+
+    void ResumeSend() {
+        TimelineSpan span("resume", "coroutine");
+        send_routine->resume();
+    }
+
+    size_t NextWindow(Sender& s) {
+        size_t window = s.WindowSize(send_threshold) / upload_chunk_size * upload_chunk_size;
+        return window ? window : upload_chunk_size;
+    }
+
+    // the file is read in chunks from the shared pool and each chunk goes out as one gathered write
+    void SendAll(Sender& s, uint64_t offset) {
         file.seekg(offset, file.beg);
-        VTP_FILE_CONTENT fc;
-        pkt_base fc_pause = {4, 0x11};
-        file.read((char*)fc.buf, 1024);
-        size_t bytes_read = file.gcount();
+        pkt_base fc_full = VTP_FILE_CONTENT::Header(1024);
+        pkt_base fc_last;
+        std::vector<iovec> chunk_iov;
         size_t bytes_sum = 0;
-        while(bytes_read > 0) {
-            fc.hdr.length = 4 + bytes_read;
-            s.Send(&fc, fc.hdr.length);
+        size_t window = NextWindow(s);
+        s.BeginWindow();
+        while(true) {
+            size_t bytes_read = ReadChunk(chunk_buffer, upload_chunk_size);
+            if(bytes_read == 0)
+                break;
+            chunk_iov.clear();
+            size_t pos = 0;
+            for(; pos + 1024 <= bytes_read; pos += 1024) {
+                chunk_iov.push_back({&fc_full, 4});
+                chunk_iov.push_back({&chunk_buffer[pos], 1024});
+            }
+            if(pos != bytes_read) {
+                fc_last = VTP_FILE_CONTENT::Header(bytes_read - pos);
+                chunk_iov.push_back({&fc_last, 4});
+                chunk_iov.push_back({&chunk_buffer[pos], bytes_read - pos});
+            }
+            s.SendV(chunk_iov.data(), chunk_iov.size());
             bytes_sum += bytes_read;
-            if(bytes_sum >= send_threshold) {
+            if(bytes_sum >= window) {
+                VTP_FILE_CONTENT::Send(s);
+                s.EndWindow(bytes_sum);
                 bytes_sum = 0;
-                s.Send(&fc_pause, 4);
+                Timeline::Shared().Instant("yield", "coroutine");
                 send_routine->yield();
+                window = NextWindow(s);
+                s.BeginWindow();
             }
-            file.read((char*)fc.buf, 1024);
-            bytes_read = file.gcount();
         }
-        VTP_FILE_END fe;
-        s.Send(&fe, 4);
+        VTP_FILE_END::Send(s);
+        s.EndWindow(bytes_sum);
     }
     
-    void InitSend(Sender& s) {
-        VTP_BEGIN_FILE bf;
-        bf.hdr.length = 12 + vita_path.length() + 1;
-        bf.hdr.type = 0x10;
-        bf.size = file_size;
-        bf.flag = 0x1;
-        s.Send(&bf, 12);
-        s.Send((void*)vita_path.c_str(), vita_path.length() + 1);
+    void EnablePipeline(bool on) {
+        pipeline_mode = on;
+    }
+
+    int32_t InitSend(Sender& s) {
+        std::string tail = vita_path;
+        tail.push_back('\0');
+        uint32_t size_h = wire_order((uint32_t)(file_size >> 32));
+        tail.append((const char*)&size_h, 4);
+        return VTP_BEGIN_FILE::SendTail(s, tail.data(), tail.length(), file_size & 0xffffffff, 0x1 | 0x2) == 0;
     }
     
     int32_t HandlePacket(Sender& s, short type, void* data, int32_t length) {
         switch(type) {
             case 0x10: {
-                int32_t result = ((int32_t*)data)[0];
-                int32_t offset = ((int32_t*)data)[1];
+                VTRP_BEGIN_FILE::View reply(data, length);
+                int32_t result = reply.Get<0>();
+                uint64_t offset = ((uint64_t)reply.Get<2>() << 32) | reply.Get<1>();
+                // devices without 64 bit support reply with result and a 32 bit offset only
+                bool wide = length >= 12;
                 if(result != 0) {
                     if(result == 1)
                         std::cout << "Not finished yet." << std::endl;
@@ -73,21 +140,48 @@ public:
                         std::cout << "Unknown error." << std::endl;
                     return 1;
                 }
-                if(send_routine)
+                if(send_routine || pipeline)
                     break;
-                auto co_fun = [this, &s](cotiny::Coroutine<>* co, int32_t off) {
-                    SendAll(s, off);
+                if(!wide && file_size > 0xffffffff) {
+                    std::cout << "device does not support files over 4 GB." << std::endl;
+                    return 1;
+                }
+                if(offset > file_size) {
+                    std::cout << "device reports offset " << offset << " beyond the file size." << std::endl;
+                    return 1;
+                }
+                if(offset)
+                    std::cout << "resuming at " << offset << "/" << file_size << " ... " << std::flush;
+                if(pipeline_mode) {
+                    file.seekg(offset, file.beg);
+                    pipeline = new CopyPipeline();
+                    pipeline->Start(s, [this](uint8_t* dst, size_t size) { return ReadChunk(dst, size); }, send_threshold, false);
+                    break;
+                }
+                auto co_fun = [this, &s, offset](cotiny::Coroutine<>* co, int32_t) {
+                    SendAll(s, offset);
                 };
-                send_routine = new cotiny::Coroutine<>(co_fun, 0x10000);
-                send_routine->resume(offset);
+                send_stack = BufferPool::Shared().Acquire(0x10000);
+                chunk_buffer = (uint8_t*)BufferPool::Shared().Acquire(upload_chunk_size);
+                send_routine = new cotiny::Coroutine<>(co_fun, 0x10000, send_stack, false);
+                ResumeSend();
+                break;
             }
             case 0x11: {
+                if(pipeline) {
+                    Timeline::Shared().Instant("ack", "net");
+                    pipeline->Credit();
+                    break;
+                }
+                Timeline::Shared().Instant("ack", "net");
+                s.WindowAcked();
                 if(send_routine)
-                    send_routine->resume();
+                    ResumeSend();
                 break;
             }
             case 0x12: {
                 std::cout << "done." << std::endl;
+                succeeded = true;
                 return 1;
                 break;
             }
@@ -96,11 +190,20 @@ public:
     }
 
 protected:
+    // the window when the sender does not size it
+    static const int32_t send_threshold = 2 * 1024 * 1024;
+    typedef SendPipeline<VTP_FILE_CONTENT, VTP_FILE_CONTENT, VTP_FILE_END> CopyPipeline;
     size_t send_res = 0;
-    size_t file_size = 0;
+    uint64_t file_size = 0;
     std::ifstream file;
     std::string vita_path;
+    std::string local_path;
     cotiny::Coroutine<>* send_routine = nullptr;
+    void* send_stack = nullptr;
+    uint8_t* chunk_buffer = nullptr;
+    bool pipeline_mode = false;
+    CopyPipeline* pipeline = nullptr;
+    bool succeeded = false;
 };
 
 #endif
@@ -33,7 +33,7 @@ namespace cotiny
     template<typename YIELD_TYPE = int32_t, typename RESUME_TYPE = int32_t>
     class Coroutine {
     public:
-        Coroutine(std::function<void(Coroutine*, RESUME_TYPE)> co_fun, size_t ssize = 0, void* = nullptr) {
+        Coroutine(std::function<void(Coroutine*, RESUME_TYPE)> co_fun, size_t ssize = 0, void* = nullptr, bool = true) {
             coroutine_func = co_fun;
             parent = GetCurrentFiber();
             if(parent == (LPVOID)0x1E00)
@@ -311,10 +311,12 @@ namespace cotiny
     public:
         // disable shared stack feature while using Address Sanitizer
         // otherwise you will get a stack-buffer-overflow error when stack memory swap
-        Coroutine(std::function<void(Coroutine*, RESUME_TYPE)> co_fun, size_t stack_size = 0x10000, void* sstack_ptr = nullptr) {
+        // with shared = false sstack_ptr is a private stack owned by the caller, no stack swap happens
+        Coroutine(std::function<void(Coroutine*, RESUME_TYPE)> co_fun, size_t stack_size = 0x10000, void* sstack_ptr = nullptr, bool shared = true) {
             coroutine_func = co_fun;
             if(sstack_ptr) {
-                share_stack = true;
+                share_stack = shared;
+                own_stack = false;
                 stack_pointer = static_cast<uint8_t*>(sstack_ptr);
             } else
                 stack_pointer = new uint8_t[stack_size];
@@ -323,7 +325,7 @@ namespace cotiny
         }
         
         ~Coroutine() {
-            if(!share_stack)
+            if(own_stack)
                 delete[] stack_pointer;
             if(stack_cache)
                 delete[] stack_cache;
@@ -395,6 +397,7 @@ namespace cotiny
         uint8_t* stack_cache = nullptr;
         uint8_t* stack_bottom = nullptr;
         bool share_stack = false;
+        bool own_stack = true;
         bool finished = false;
         int32_t stack_cache_size = 0;
         int32_t stack_cache_reserve = 0;
@@ -0,0 +1,161 @@
+#ifndef _DEFLATE_POOL_H_
+#define _DEFLATE_POOL_H_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "buffer_pool.h"
+
+struct DeflateSegment {
+    uint64_t offset = 0;
+    uint32_t size = 0;
+};
+
+struct DeflateJob {
+    uint64_t src_offset = 0;
+    uint64_t src_size = 0;
+    uint32_t block_count = 0;
+    uint32_t blocks_done = 0;
+    uint64_t comp_size = 0;
+    std::vector<DeflateSegment> segments;
+};
+
+// compresses ranges of a file on all cores, pigz style:
+// every block is deflated independently and ends byte aligned with a sync flush, only the last block
+// of a job is finished, so the concatenated segments of a job form one raw deflate stream.
+// results are spooled to an unlinked temp file, memory stays at one block per thread
+class DeflatePool {
+public:
+    static const uint32_t block_size = 128 * 1024;
+
+    ~DeflatePool() {
+        {
+            std::unique_lock<std::mutex> lock(pool_mutex);
+            next_job = jobs.size();
+        }
+        for(auto& th : workers)
+            th.join();
+        if(src_fd >= 0)
+            close(src_fd);
+        if(spool_fd >= 0)
+            close(spool_fd);
+    }
+
+    size_t AddJob(uint64_t offset, uint64_t size) {
+        DeflateJob job;
+        job.src_offset = offset;
+        job.src_size = size;
+        job.block_count = (size + block_size - 1) / block_size;
+        job.segments.resize(job.block_count);
+        jobs.push_back(job);
+        return jobs.size() - 1;
+    }
+
+    bool Start(const std::string& src_file, int32_t thread_count, int32_t level) {
+        char spool_name[] = "/tmp/vitamgr_spool_XXXXXX";
+        src_fd = open(src_file.c_str(), O_RDONLY);
+        spool_fd = mkstemp(spool_name);
+        if(src_fd < 0 || spool_fd < 0)
+            return false;
+        unlink(spool_name);
+        comp_level = level;
+        if(thread_count < 1)
+            thread_count = 1;
+        for(int32_t i = 0; i < thread_count; ++i)
+            workers.emplace_back([this]() { Work(); });
+        return true;
+    }
+
+    void Wait() {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        pool_cond.wait(lock, [this]() { return blocks_pending == 0 && next_job >= jobs.size(); });
+    }
+
+    DeflateJob& GetJob(size_t idx) {
+        return jobs[idx];
+    }
+
+    bool Read(const DeflateSegment& seg, uint32_t offset, void* dst, uint32_t size) {
+        return pread(spool_fd, dst, size, seg.offset + offset) == (ssize_t)size;
+    }
+
+protected:
+    void Work() {
+        // one allocation per worker, two separate acquires could deadlock under the memory cap
+        size_t out_size_max = deflateBound(nullptr, block_size) + 16;
+        uint8_t* in_buf = (uint8_t*)BufferPool::Shared().Acquire(block_size + out_size_max);
+        uint8_t* out_buf = in_buf + block_size;
+        while(true) {
+            size_t job_idx = 0;
+            uint32_t block_idx = 0;
+            {
+                std::unique_lock<std::mutex> lock(pool_mutex);
+                if(next_job >= jobs.size())
+                    break;
+                job_idx = next_job;
+                block_idx = next_block++;
+                if(next_block >= jobs[job_idx].block_count) {
+                    next_job++;
+                    next_block = 0;
+                }
+                blocks_pending++;
+            }
+            DeflateJob& job = jobs[job_idx];
+            uint64_t offset = (uint64_t)block_idx * block_size;
+            uint32_t size = (job.src_size - offset < block_size) ? (uint32_t)(job.src_size - offset) : block_size;
+            bool last = (block_idx + 1 == job.block_count);
+            uint32_t out_size = 0;
+            if(pread(src_fd, in_buf, size, job.src_offset + offset) == (ssize_t)size) {
+                z_stream cstr;
+                memset(&cstr, 0, sizeof(cstr));
+                deflateInit2(&cstr, comp_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+                cstr.next_in = in_buf;
+                cstr.avail_in = size;
+                cstr.next_out = out_buf;
+                cstr.avail_out = out_size_max;
+                deflate(&cstr, last ? Z_FINISH : Z_SYNC_FLUSH);
+                out_size = out_size_max - cstr.avail_out;
+                deflateEnd(&cstr);
+            } else {
+                // unreadable input, make the job look incompressible so it is sent stored
+                out_size = 0;
+            }
+            DeflateSegment seg;
+            {
+                std::unique_lock<std::mutex> lock(pool_mutex);
+                seg.offset = spool_size;
+                spool_size += out_size;
+            }
+            seg.size = out_size;
+            if(out_size && pwrite(spool_fd, out_buf, out_size, seg.offset) != (ssize_t)out_size)
+                seg.size = 0;
+            {
+                std::unique_lock<std::mutex> lock(pool_mutex);
+                job.segments[block_idx] = seg;
+                job.comp_size += seg.size ? seg.size : block_size + 1;
+                job.blocks_done++;
+                blocks_pending--;
+            }
+            pool_cond.notify_all();
+        }
+        BufferPool::Shared().Release(in_buf, block_size + out_size_max);
+    }
+
+    std::vector<DeflateJob> jobs;
+    std::vector<std::thread> workers;
+    std::mutex pool_mutex;
+    std::condition_variable pool_cond;
+    size_t next_job = 0;
+    uint32_t next_block = 0;
+    uint32_t blocks_pending = 0;
+    uint64_t spool_size = 0;
+    int32_t comp_level = Z_DEFAULT_COMPRESSION;
+    int32_t src_fd = -1;
+    int32_t spool_fd = -1;
+};
+
+#endif
@@ -1,90 +1,133 @@
 #ifndef _DOWN_HANDLER_H_
 #define _DOWN_HANDLER_H_
 
+#include <fcntl.h>
+
 #include "common.h"
-#include "cotiny.hh"
+#include "timeline.h"
 
-class CopyHandler : public PacketHandler {
+class DownHandler : public PacketHandler {
 public:
-    ~CopyHandler() {
-        if(send_routine)
-            delete send_routine;
+    // an unfinished download never replaces the local file
+    ~DownHandler() {
+        if(fd >= 0) {
+            close(fd);
+            unlink(tmp_path.c_str());
+        }
     }
-    
-    bool Load(const std::string& src_file, const std::string& remote_path) {
-        file.open(src_file, std::ios::in | std::ios::binary);
-        if(!file)
+
+    // content goes to dst_file.tmp, it is renamed over dst_file once the device ends the transfer
+    bool Load(const std::string& remote_path, const std::string& dst_file) {
+        if(!VTP_DOWN_FILE::Fits(remote_path.length() + 1)) {
+            std::cout << "remote path " << remote_path << " is too long." << std::endl;
+            return false;
+        }
+        local_path = dst_file;
+        tmp_path = dst_file + ".tmp";
+        fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0)
             return false;
-        file.seekg(0, file.end);
-        file_size = file.tellg();
         vita_path = remote_path;
         return true;
     }
-    
-    void SendAll(Sender& s, int32_t offset) {
-        static const int32_t send_threshold = 2 * 1024 * 1024;
-        file.seekg(offset, file.beg);
-        VTP_FILE_CONTENT fc;
-        pkt_base fc_pause = {4, 0x11};
-        file.read((char*)fc.buf, 1024);
-        size_t bytes_read = file.gcount();
-        size_t bytes_sum = 0;
-        while(bytes_read > 0) {
-            fc.hdr.length = 4 + bytes_read;
-            s.Send(&fc, fc.hdr.length);
-            bytes_sum += bytes_read;
-            if(bytes_sum >= send_threshold) {
-                bytes_sum = 0;
-                s.Send(&fc_pause, 4);
-                send_routine->yield();
-            }
-            file.read((char*)fc.buf, 1024);
-            bytes_read = file.gcount();
-        }
-        VTP_FILE_END fe;
-        s.Send(&fe, 4);
+
+    int32_t InitSend(Sender& s) {
+        return VTP_DOWN_FILE::SendTail(s, vita_path) == 0;
     }
-    
-    void InitSend(Sender& s) {
-        VTP_DOWN_FILE df;
-        bf.hdr.length = 12 + vita_path.length() + 1;
-        bf.hdr.type = 0x10;
-        bf.size = file_size;
-        bf.flag = 0x1;
-        s.Send(&bf, 12);
-        s.Send((void*)vita_path.c_str(), vita_path.length() + 1);
+
+    // content is written straight from the receive buffer to its final position,
+    // the previous window is handed to writeback before the device is allowed to continue
+    // so disk writes overlap with the receive of the next window
+    void FlushWindow() {
+#ifdef __linux__
+        if(file_offset > window_offset)
+            sync_file_range(fd, window_offset, file_offset - window_offset, SYNC_FILE_RANGE_WRITE);
+#endif
+        window_offset = file_offset;
     }
-    
+
     int32_t HandlePacket(Sender& s, short type, void* data, int32_t length) {
         switch(type) {
             case 0x13: {
-                int32_t result = ((int32_t*)data)[0];
-                int32_t fsize = ((int32_t*)data)[1];
+                VTRP_DOWN_FILE::View reply(data, length);
+                int32_t result = reply.Get<0>();
                 if(result != 0) {
-
+                    if(result == 1)
+                        std::cout << "Not finished yet." << std::endl;
+                    else if(result == 2)
+                        std::cout << "User canceled." << std::endl;
+                    else if(result == 4)
+                        std::cout << "Cannot open file." << std::endl;
+                    else
+                        std::cout << "Unknown error." << std::endl;
+                    return 1;
                 }
-                
+                file_size = reply.Get<1>();
+                if(file_size) {
+#ifdef __linux__
+                    if(fallocate(fd, 0, 0, file_size) != 0)
+#endif
+                    if(ftruncate(fd, file_size) != 0) {
+                        std::cout << "cannot size local file." << std::endl;
+                        return 1;
+                    }
+                }
+                std::cout << "Downloading " << vita_path << " ... [0/" << file_size << "] " << std::flush;
+                s.WindowReleased();
+                break;
             }
             case 0x14: {
-                if(send_routine)
-                    send_routine->resume();
+                if(length == 0) {
+                    // pause marker, release the device for the next window
+                    Timeline::Shared().Instant("pause", "net");
+                    s.EndWindow(file_offset - window_offset);
+                    FlushWindow();
+                    VTP_DOWN_CONTINE::Send(s);
+                    s.WindowReleased();
+                    std::cout << "\rDownloading " << vita_path << " ... [" << file_offset << "/" << file_size << "] " << std::flush;
+                    break;
+                }
+                TimelineSpan span("write", "io", length);
+                if(pwrite(fd, data, length, file_offset) != length) {
+                    std::cout << "write error." << std::endl;
+                    return 1;
+                }
+                file_offset += length;
                 break;
             }
             case 0x15: {
-                std::cout << "done." << std::endl;
+                FlushWindow();
+                // the device stopped early (a read error there), the local file stays as it was
+                if(file_offset != file_size) {
+                    close(fd);
+                    fd = -1;
+                    unlink(tmp_path.c_str());
+                    std::cout << "\rDownloading " << vita_path << " ... short read, got " << file_offset << " of "
+                        << file_size << " bytes, " << local_path << " not replaced." << std::endl;
+                    return 1;
+                }
+                bool ok = close(fd) == 0 && rename(tmp_path.c_str(), local_path.c_str()) == 0;
+                fd = -1;
+                if(!ok) {
+                    unlink(tmp_path.c_str());
+                    std::cout << "\rDownloading " << vita_path << " ... cannot replace " << local_path << "." << std::endl;
+                    return 1;
+                }
+                std::cout << "\rDownloading " << vita_path << " ... [" << file_offset << "/" << file_size << "] done." << std::endl;
                 return 1;
-                break;
             }
         }
         return 0;
     }
 
 protected:
-    size_t send_res = 0;
+    int32_t fd = -1;
     size_t file_size = 0;
-    std::ifstream file;
+    size_t file_offset = 0;
+    size_t window_offset = 0;
     std::string vita_path;
-    cotiny::Coroutine<>* send_routine = nullptr;
+    std::string local_path;
+    std::string tmp_path;
 };
 
 #endif
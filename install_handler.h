@@ -2,9 +2,22 @@
 #define _INSTALL_HANDLER_H_
 
 #include <zlib.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <limits.h>
 
 #include "common.h"
 #include "cotiny.hh"
+#include "install_manifest.h"
+#include "deflate_pool.h"
+#include "buffer_pool.h"
+#include "send_pipeline.h"
+#include "net_tuning.h"
+#include "timeline.h"
+#include "zip_entry_table.h"
+#include "stream_cache.h"
 
 const int32_t ZIP_FILE_SIZE = 30;
 const int32_t ZIP_DIRECTORY_SIZE = 46;
@@ -82,31 +95,159 @@ struct ZipEndBlock {
 } __attribute__((packed));
 #endif
 
-struct ZipFileInfo {
-    bool compressed = false;
-    size_t data_offset = 0;
-    size_t comp_size = 0;
-    size_t file_size = 0;
-};
-
 class InstallHandler : public PacketHandler {
 public:
     ~InstallHandler() {
+        // the pipeline reads the vpk and the deflate spool, stop it first
+        if(pipeline)
+            delete pipeline;
         if(send_routine)
             delete send_routine;
-        if(send_buffer)
-            delete[] send_buffer;
+        BufferPool::Shared().Release(send_stack, 0x10000);
+        BufferPool::Shared().Release(send_buffer, send_buffer_capacity);
+        if(deflate_pool)
+            delete deflate_pool;
     }
     bool Load(const std::string& src_file) {
-        char name_buffer[1024];
-        ZipEndBlock end_block;
         zip_file.open(src_file, std::ios::in | std::ios::binary);
         if(!zip_file)
             return false;
+        zip_path = src_file;
         zip_file.seekg(0, zip_file.end);
         size_t file_size = zip_file.tellg();
         if(file_size == 0)
             return false;
+        if(LoadIndexCache(src_file))
+            return true;
+        if(!ScanDirectory(file_size))
+            return false;
+        // the eboot inspection runs beside the local header walk
+        ZipFileInfo eboot_info = entries.Info(entries.Find("eboot.bin"));
+        std::thread eboot_thread([this, &src_file, eboot_info]() {
+            auto begin = std::chrono::steady_clock::now();
+            std::ifstream f(src_file, std::ios::in | std::ios::binary);
+            auth_flag = InspectEboot(f, eboot_info);
+            eboot_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        });
+        bool resolved = ResolveDataStarts();
+        if(resolved)
+            title_id = ReadTitleId();
+        eboot_thread.join();
+        if(!resolved)
+            return false;
+        SaveIndexCache();
+        return true;
+    }
+
+    // seconds spent inflating the eboot header during Load, 0 when the index came from the cache
+    double EbootTime() {
+        return eboot_time;
+    }
+
+    // the index of a vpk is cached in ~/.vitamgr, keyed by path, size, mtime and inode
+    bool MakeIndexKey(const std::string& src_file) {
+        struct stat st;
+        char real_path[PATH_MAX];
+        if(stat(src_file.c_str(), &st) != 0 || !realpath(src_file.c_str(), real_path))
+            return false;
+        index_key.path = real_path;
+        index_key.size = st.st_size;
+        index_key.mtime = stat_mtime_ns(st);
+        index_key.inode = st.st_ino;
+        char name[32];
+        snprintf(name, sizeof(name), "vpk_%016llx.idx", (unsigned long long)std::hash<std::string>()(index_key.path));
+        index_path = cache_path(name);
+        return true;
+    }
+
+    bool LoadIndexCache(const std::string& src_file) {
+        if(!MakeIndexKey(src_file))
+            return false;
+        std::ifstream f(index_path, std::ios::in | std::ios::binary);
+        if(!f)
+            return false;
+        uint32_t magic = 0, version = 0, count = 0;
+        ZipIndexKey key;
+        f.read((char*)&magic, 4);
+        f.read((char*)&version, 4);
+        if(magic != index_magic || version != index_version)
+            return false;
+        key.path = read_string(f);
+        f.read((char*)&key.size, 8);
+        f.read((char*)&key.mtime, 8);
+        f.read((char*)&key.inode, 8);
+        if(!f || key.path != index_key.path || key.size != index_key.size || key.mtime != index_key.mtime || key.inode != index_key.inode)
+            return false;
+        f.read((char*)&total_size, 8);
+        f.read((char*)&auth_flag, 4);
+        title_id = read_string(f);
+        f.read((char*)&count, 4);
+        entries.Clear();
+        entries.Reserve(count, count * 32);
+        char name_buffer[0x10000];
+        for(uint32_t i = 0; i < count && f; ++i) {
+            uint16_t name_size = 0;
+            f.read((char*)&name_size, 2);
+            if(name_size > max_entry_name) {
+                f.setstate(std::ios::failbit);
+                break;
+            }
+            f.read(name_buffer, name_size);
+            size_t idx = entries.Add(name_buffer, name_size);
+            f.read((char*)&entries.compressed[idx], 1);
+            f.read((char*)&entries.data_offset[idx], 8);
+            f.read((char*)&entries.data_start[idx], 8);
+            f.read((char*)&entries.comp_size[idx], 8);
+            f.read((char*)&entries.file_size[idx], 8);
+            f.read((char*)&entries.crc32[idx], 4);
+        }
+        if(f)
+            entries.Finish();
+        if(!f || entries.Find("eboot.bin") == ZipEntryTable::npos) {
+            entries.Clear();
+            return false;
+        }
+        return true;
+    }
+
+    void SaveIndexCache() {
+        if(index_path.empty())
+            return;
+        // unique per process and thread, two loads of one vpk must not write the same file
+        std::string tmp_path = index_path + "." + std::to_string(getpid()) + "_"
+            + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+        std::ofstream f(tmp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if(!f)
+            return;
+        uint32_t magic = index_magic;
+        uint32_t version = index_version;
+        uint32_t count = entries.Size();
+        f.write((const char*)&magic, 4);
+        f.write((const char*)&version, 4);
+        write_string(f, index_key.path);
+        f.write((const char*)&index_key.size, 8);
+        f.write((const char*)&index_key.mtime, 8);
+        f.write((const char*)&index_key.inode, 8);
+        f.write((const char*)&total_size, 8);
+        f.write((const char*)&auth_flag, 4);
+        write_string(f, title_id);
+        f.write((const char*)&count, 4);
+        for(size_t i = 0; i < entries.Size(); ++i) {
+            write_string(f, entries.Name(i));
+            f.write((const char*)&entries.compressed[i], 1);
+            f.write((const char*)&entries.data_offset[i], 8);
+            f.write((const char*)&entries.data_start[i], 8);
+            f.write((const char*)&entries.comp_size[i], 8);
+            f.write((const char*)&entries.file_size[i], 8);
+            f.write((const char*)&entries.crc32[i], 4);
+        }
+        f.close();
+        if(!f || rename(tmp_path.c_str(), index_path.c_str()) != 0)
+            unlink(tmp_path.c_str());
+    }
+
+    bool ScanDirectory(size_t file_size) {
+        ZipEndBlock end_block;
         zip_file.seekg(-ZIP_END_BLOCK_SIZE, zip_file.end);
         zip_file.read((char*)&end_block, ZIP_END_BLOCK_SIZE);
         if(end_block.block_header != 0x06054b50) {
@@ -127,154 +268,634 @@ public:
             if(end_block_pos == -1)
                 return false;
             zip_file.seekg(-(end_buffer_size - end_block_pos), zip_file.end);
+            zip_file.read((char*)&end_block, ZIP_END_BLOCK_SIZE);
         }
-        zip_file.seekg(end_block.directory_offset, zip_file.beg);
-        ZipDirectoryHeader* dir_header = nullptr;
-        char* buffer = new char[end_block.directory_size];
-        zip_file.read(buffer, end_block.directory_size);
-        auto pos = 0;
-        entries.clear();
+        // the directory is streamed in chunks, the tail of a chunk is carried over so
+        // the refill always leaves room for the longest possible record
+        static const size_t dir_chunk_size = 64 * 1024;
+        static const size_t max_record_size = ZIP_DIRECTORY_SIZE + 3 * 0xffff;
+        size_t dir_size = (uint32_t)end_block.directory_size;
+        size_t dir_count = (uint16_t)end_block.directory_count;
+        size_t dir_left = dir_size;
+        std::vector<char> buffer(dir_chunk_size + max_record_size);
+        size_t begin = 0, end = 0;
+        entries.Clear();
+        entries.Reserve(dir_count, dir_size > dir_count * ZIP_DIRECTORY_SIZE ? dir_size - dir_count * ZIP_DIRECTORY_SIZE : 0);
         total_size = 0;
-        while(pos + ZIP_DIRECTORY_SIZE < end_block.directory_size) {
-            while(buffer[pos] != 0x50 && pos + ZIP_DIRECTORY_SIZE < end_block.directory_size)
-                ++pos;
-            if(buffer[pos] == 0x50) {
-                dir_header = reinterpret_cast<ZipDirectoryHeader*>(&buffer[pos]);
-                if(dir_header->block_header != 0x02014b50)
-                    continue;
-                memcpy(name_buffer, &buffer[pos + ZIP_DIRECTORY_SIZE], dir_header->name_size);
-                name_buffer[dir_header->name_size] = 0;
-                if(!(dir_header->exter_att & 0x10) && (name_buffer[dir_header->name_size - 1] != '/')) { // dir
-                    std::string name = name_buffer;
-                    ZipFileInfo& finfo = entries[name];
-                    finfo.compressed = (dir_header->comp_fun == 0x8);
-                    finfo.comp_size = dir_header->comp_size;
-                    finfo.file_size = dir_header->file_size;
-                    finfo.data_offset = dir_header->data_offset;
+        zip_file.seekg((uint32_t)end_block.directory_offset, zip_file.beg);
+        while(true) {
+            if(end - begin < max_record_size && dir_left) {
+                memmove(buffer.data(), &buffer[begin], end - begin);
+                end -= begin;
+                begin = 0;
+                size_t len = std::min(dir_left, buffer.size() - end);
+                zip_file.read(&buffer[end], len);
+                if(!zip_file)
+                    return false;
+                end += len;
+                dir_left -= len;
+            }
+            if(end - begin < (size_t)ZIP_DIRECTORY_SIZE)
+                break;
+            ZipDirectoryHeader dir_header;
+            memcpy(&dir_header, &buffer[begin], ZIP_DIRECTORY_SIZE);
+            if(dir_header.block_header != 0x02014b50) {
+                ++begin;
+                continue;
+            }
+            size_t name_size = (uint16_t)dir_header.name_size;
+            size_t record_size = ZIP_DIRECTORY_SIZE + name_size + (uint16_t)dir_header.ex_size + (uint16_t)dir_header.cmt_size;
+            // a record running past the end of the directory is a broken archive
+            if(record_size > end - begin)
+                return false;
+            const char* name = &buffer[begin + ZIP_DIRECTORY_SIZE];
+            if(name_size && !(dir_header.exter_att & 0x10) && name[name_size - 1] != '/') { // dir
+                // nlen of its record has 15 bits, bit 15 marks a deflated entry
+                if(name_size > max_entry_name) {
+                    std::cout << "entry name of " << name_size << " bytes is too long." << std::endl;
+                    return false;
                 }
-                pos += ZIP_DIRECTORY_SIZE + dir_header->name_size + dir_header->ex_size + dir_header->cmt_size;
-                total_size += dir_header->comp_size;
+                size_t idx = entries.Add(name, name_size);
+                entries.compressed[idx] = (dir_header.comp_fun == 0x8);
+                entries.comp_size[idx] = (uint32_t)dir_header.comp_size;
+                entries.file_size[idx] = (uint32_t)dir_header.file_size;
+                entries.data_offset[idx] = (uint32_t)dir_header.data_offset;
+                entries.crc32[idx] = dir_header.crc32;
             }
+            begin += record_size;
+            total_size += (uint32_t)dir_header.comp_size;
         }
-        delete[] buffer;
-        if(entries.empty())
+        if(entries.Empty())
             return false;
-        if(entries.find("eboot.bin") == entries.end())
+        entries.Finish();
+        if(entries.Find("eboot.bin") == ZipEntryTable::npos)
             return false;
         return true;
     }
+
+    // eboot.bin and sce_sys/ go first, a device checking them can reject a broken
+    // package before the bulk of it is sent. the rest keeps name order
+    static int32_t EntryPriority(const EntryName& name) {
+        if(name == "eboot.bin")
+            return 0;
+        if(name == "sce_sys/param.sfo")
+            return 1;
+        if(name.length >= 8 && memcmp(name.data, "sce_sys/", 8) == 0)
+            return 2;
+        return 3;
+    }
+
+    // name order unless the device confirmed it checks the headers early
+    void OrderEntries(bool headers_first) {
+        std::vector<int32_t> priority(entries.Size());
+        send_order.resize(entries.Size());
+        for(size_t i = 0; i < entries.Size(); ++i) {
+            priority[i] = headers_first ? EntryPriority(entries.NameRef(i)) : 0;
+            send_order[i] = i;
+        }
+        std::stable_sort(send_order.begin(), send_order.end(), [&priority](uint32_t a, uint32_t b) {
+            return priority[a] < priority[b];
+        });
+    }
+
+    // resolve where the data of each entry begins so sending never touches local headers again
+    bool ResolveDataStarts() {
+        ZipFileHeader file_header;
+        for(size_t i = 0; i < entries.Size(); ++i) {
+            zip_file.seekg(entries.data_offset[i], zip_file.beg);
+            zip_file.read((char*)&file_header, ZIP_FILE_SIZE);
+            if(!zip_file || file_header.block_header != 0x04034b50)
+                return false;
+            entries.data_start[i] = entries.data_offset[i] + ZIP_FILE_SIZE + file_header.name_size + file_header.ex_size;
+        }
+        return true;
+    }
     
+    // the whole window goes out as one gathered write, headers stay members since
+    // a zero-copy send may still reference them after SendV returns
     void SendBuffer(Sender&s) {
-        VTP_VPK_CONTENT vc;
-        pkt_base vc_pause = {4, 0x14};
         size_t offset = 0;
-        vc.hdr.length = 1028;
+        send_iov.clear();
         while(offset + 1024 <= send_buffer_size) {
-            s.Send(&vc, 4);
-            s.Send(&send_buffer[offset], 1024);
+            send_iov.push_back({&vc_full, 4});
+            send_iov.push_back({&send_buffer[offset], 1024});
             offset += 1024;
         }
         if(offset != send_buffer_size) {
-            vc.hdr.length = 4 + send_buffer_size - offset;
-            s.Send(&vc, 4);
-            s.Send(&send_buffer[offset], send_buffer_size - offset);
+            vc_last = VTP_VPK_CONTENT::Header(send_buffer_size - offset);
+            send_iov.push_back({&vc_last, 4});
+            send_iov.push_back({&send_buffer[offset], send_buffer_size - offset});
         }
-        s.Send(&vc_pause, 4);
+        send_iov.push_back({&vc_pause, 4});
+        stream_cache.Append(send_buffer, send_buffer_size);
+        s.BeginWindow();
+        s.SendV(send_iov.data(), send_iov.size(), true);
+        s.EndWindow(send_buffer_size);
     }
 
-    void SendAll(Sender& s) {
-        static const int32_t send_threshold = 2 * 1024 * 1024;
+    // nlen, path and csize of an entry record, csize -1 removes the installed file in patch mode
+    // nlen bit 15 marks an entry deflated by the client, the device has to inflate it
+    static size_t EncodeRecordHeader(uint8_t* dst, const char* name, size_t name_len, int32_t csize, bool deflated) {
         static const char* path_prefix = "ux0:ptmp/pkg/";
-        ZipFileHeader file_header;
+        uint16_t nlen = name_len + 13;
+        if(deflated)
+            nlen |= 0x8000;
+        nlen = wire_order(nlen);
+        csize = wire_order(csize);
+        memcpy(dst, &nlen, 2);
+        memcpy(dst + 2, path_prefix, 13);
+        memcpy(dst + 15, name, name_len);
+        memcpy(dst + 15 + name_len, &csize, 4);
+        return 19 + name_len;
+    }
+
+    void PutRecordHeader(const char* name, size_t name_len, int32_t csize, bool deflated = false) {
+        send_buffer_size += EncodeRecordHeader(&send_buffer[send_buffer_size], name, name_len, csize, deflated);
+    }
+
+    // param.sfo is always sent, the device identifies the title to patch by it
+    bool IsChanged(size_t idx) {
+        if(!patch_mode)
+            return true;
+        EntryName name = entries.NameRef(idx);
+        return name == "sce_sys/param.sfo" || manifest.IsChanged(name.data, name.length, entries.crc32[idx], entries.file_size[idx]);
+    }
+
+    // entries are read from the vpk, or from the deflate spool when recompressed
+    int32_t BeginEntryData(size_t idx) {
+        if(entries.deflate_job[idx] >= 0) {
+            read_job = &deflate_pool->GetJob(entries.deflate_job[idx]);
+            read_segment = 0;
+            read_offset = 0;
+            return read_job->comp_size;
+        }
+        read_job = nullptr;
+        zip_file.seekg(entries.data_start[idx], zip_file.beg);
+        return entries.comp_size[idx];
+    }
+
+    void ReadEntryData(uint8_t* dst, uint32_t size) {
+        TimelineSpan span("read", "io", size);
+        if(!read_job) {
+            zip_file.read((char*)dst, size);
+            return;
+        }
+        while(size) {
+            auto& seg = read_job->segments[read_segment];
+            uint32_t chunk = (seg.size - read_offset < size) ? seg.size - read_offset : size;
+            deflate_pool->Read(seg, read_offset, dst, chunk);
+            dst += chunk;
+            size -= chunk;
+            read_offset += chunk;
+            if(read_offset == seg.size) {
+                read_segment++;
+                read_offset = 0;
+            }
+        }
+    }
+
+    // the record stream as plain bytes for the pipeline reader, same records as SendAll
+    size_t ReadStream(uint8_t* dst, size_t size) {
+        size_t got = 0;
+        while(got < size) {
+            if(stream_head_pos < stream_head.size()) {
+                size_t len = std::min(size - got, stream_head.size() - stream_head_pos);
+                memcpy(dst + got, &stream_head[stream_head_pos], len);
+                stream_head_pos += len;
+                got += len;
+            } else if(stream_left) {
+                size_t len = std::min<size_t>(size - got, stream_left);
+                ReadEntryData(dst + got, len);
+                stream_left -= len;
+                got += len;
+                if(stream_left == 0) {
+                    Timeline::Shared().AsyncEnd("entry", "install", stream_count);
+                    Progress("done.\n");
+                }
+            } else if(!NextRecord())
+                break;
+        }
+        stream_cache.Append(dst, got);
+        return got;
+    }
+
+    bool NextRecord() {
+        while(stream_pos < send_order.size() && !IsChanged(send_order[stream_pos]))
+            ++stream_pos;
+        if(stream_pos < send_order.size()) {
+            size_t idx = send_order[stream_pos];
+            EntryName name = entries.NameRef(idx);
+            int32_t csize = BeginEntryData(idx);
+            stream_head.resize(19 + name.length);
+            EncodeRecordHeader(stream_head.data(), name.data, name.length, csize, entries.deflate_job[idx] >= 0);
+            stream_head_pos = 0;
+            stream_left = csize;
+            Progress("[" + std::to_string(++stream_count) + "/" + std::to_string(stream_total) + "]: Uploading " + name.Str()
+                + " (" + std::to_string(csize) + " bytes) ... " + (csize ? "" : "done.\n"));
+            if(Timeline::On())
+                Timeline::Shared().AsyncBegin("entry", "install", stream_count, name.Str());
+            if(csize == 0)
+                Timeline::Shared().AsyncEnd("entry", "install", stream_count);
+            ++stream_pos;
+            return true;
+        }
+        if(patch_mode && stream_removed < removed_entries.size()) {
+            auto& name = removed_entries[stream_removed++];
+            stream_head.resize(19 + name.length());
+            EncodeRecordHeader(stream_head.data(), name.c_str(), name.length(), -1, false);
+            stream_head_pos = 0;
+            Progress("Removing " + name + "\n");
+            return true;
+        }
+        return false;
+    }
+
+    // the pipeline reader runs on its own thread, its progress is printed by the main thread at each ack
+    void Progress(const std::string& text) {
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        progress_text += text;
+    }
+
+    void PrintProgress() {
+        std::string text;
+        {
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            text.swap(progress_text);
+        }
+        std::cout << text << std::flush;
+    }
+
+    // the window the memory cap leaves room for, the coroutine path gets the same bound from its send buffer
+    size_t WindowLimit() {
+        size_t limit = BufferPool::Shared().Limit();
+        size_t reserved = record_slack + 0x10000;
+        if(!limit || limit >= max_send_threshold + reserved)
+            return max_send_threshold;
+        return limit > min_send_buffer + reserved ? limit - reserved : min_send_buffer;
+    }
+
+    // the sender sizes each window, the send buffer caps it.
+    // only called between windows, the buffer holds nothing then and can be swapped for a larger one
+    void UpdateThreshold(Sender& s) {
+        size_t window = s.WindowSize(default_send_threshold);
+        if(window > send_limit && send_limit < WindowLimit())
+            GrowSendBuffer(window);
+        send_threshold = std::min<size_t>(window, send_limit);
+    }
+
+    // a larger buffer only if the pool has one right now, else the held size again
+    void GrowSendBuffer(size_t window) {
+        size_t wanted = std::min(window, WindowLimit()) + record_slack;
+        size_t held = send_buffer_capacity;
+        if(!send_buffer) {
+            send_buffer = (uint8_t*)BufferPool::Shared().Acquire(wanted, min_send_buffer, send_buffer_capacity);
+        } else {
+            BufferPool::Shared().Release(send_buffer, held);
+            send_buffer = (uint8_t*)BufferPool::Shared().Acquire(wanted, held + 1, send_buffer_capacity, false);
+            if(!send_buffer)
+                send_buffer = (uint8_t*)BufferPool::Shared().Acquire(held, held, send_buffer_capacity);
+        }
+        send_limit = send_buffer_capacity - record_slack;
+        if(send_limit > max_send_threshold)
+            send_limit = max_send_threshold;
+    }
+
+    void ResumeSend() {
+        TimelineSpan span("resume", "coroutine");
+        send_routine->resume();
+    }
+
+    void EnablePipeline(bool on) {
+        pipeline_mode = on;
+    }
+
+    // flag 0x40, eboot.bin and sce_sys/ first so the device can abort early
+    void EnableHeadersFirst(bool on) {
+        headers_first = on;
+    }
+
+    // start reading the archive into the page cache while something else keeps the device busy
+    void Prefetch() {
+#ifdef POSIX_FADV_WILLNEED
+        if(stream_cached) {
+            posix_fadvise(stream_cache.Fd(), 0, 0, POSIX_FADV_WILLNEED);
+            return;
+        }
+        int32_t fd = open(zip_path.c_str(), O_RDONLY);
+        if(fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+#endif
+    }
+
+    // full installs are served from the framed stream of an earlier install when there is one
+    // for this vpk and deflate level, otherwise the stream is recorded while it is sent.
+    // true when the cache will be served, recompressing is pointless then
+    bool EnableStreamCache(int32_t level) {
+        stream_cache_mode = !patch_mode && !index_path.empty();
+        stream_level = level;
+        stream_cached = stream_cache_mode && stream_cache.Open(index_key, level);
+        return stream_cached;
+    }
+
+    bool UsesStreamCache() {
+        return stream_cached;
+    }
+
+    bool Succeeded() {
+        return succeeded;
+    }
+
+    // the stream broke off mid packet, nothing more can be sent on this connection
+    bool Broken() {
+        return broken;
+    }
+
+    const std::string& TitleId() {
+        return title_id;
+    }
+
+    void SendAll(Sender& s) {
         send_buffer_size = 0;
         int32_t file_count = 1;
         int64_t bytes_sent = 0;
-        for(auto& iter : entries) {
-            short nlen = iter.first.length() + 13;
-            int32_t csize = iter.second.comp_size;
-            memcpy(&send_buffer[send_buffer_size], &nlen, 2);
-            send_buffer_size += 2;
-            memcpy(&send_buffer[send_buffer_size], path_prefix, 13);
-            send_buffer_size += 13;
-            memcpy(&send_buffer[send_buffer_size], iter.first.c_str(), iter.first.length());
-            send_buffer_size += iter.first.length();
-            memcpy(&send_buffer[send_buffer_size], &csize, 4);
-            send_buffer_size += 4;
-            zip_file.seekg(iter.second.data_offset, zip_file.beg);
-            zip_file.read((char*)&file_header, ZIP_FILE_SIZE);
-            zip_file.seekg(file_header.name_size + file_header.ex_size, zip_file.cur);
-            int32_t bytes_left = file_header.comp_size;
-            std::cout << "[" << file_count << "/" << entries.size() << "]: Uploading " << iter.first
-                << " ... [0/" << file_header.comp_size << "] " << std::flush;
+        size_t send_count = 0;
+        for(size_t i = 0; i < entries.Size(); ++i)
+            if(IsChanged(i))
+                send_count++;
+        for(auto i : send_order) {
+            if(!IsChanged(i))
+                continue;
+            EntryName name = entries.NameRef(i);
+            int32_t csize = BeginEntryData(i);
+            PutRecordHeader(name.data, name.length, csize, entries.deflate_job[i] >= 0);
+            if(Timeline::On())
+                Timeline::Shared().AsyncBegin("entry", "install", file_count, name.Str());
+            int32_t bytes_left = csize;
+            std::cout << "[" << file_count << "/" << send_count << "]: Uploading " << name
+                << " ... [0/" << csize << "] " << std::flush;
             while(bytes_left != 0) {
                 if(bytes_left + send_buffer_size <= send_threshold) {
-                    zip_file.read((char*)&send_buffer[send_buffer_size], bytes_left);
+                    ReadEntryData(&send_buffer[send_buffer_size], bytes_left);
                     send_buffer_size += bytes_left;
                     bytes_left = 0;
-                    std::cout << "\r[" << file_count << "/" << entries.size() << "]: Uploading " << iter.first
-                         << " ... [" << file_header.comp_size << "/" << file_header.comp_size << "] " << std::flush;
+                    std::cout << "\r[" << file_count << "/" << send_count << "]: Uploading " << name
+                         << " ... [" << csize << "/" << csize << "] " << std::flush;
                 } else {
                     if(send_buffer_size < send_threshold) {
-                        zip_file.read((char*)&send_buffer[send_buffer_size], send_threshold - send_buffer_size);
+                        ReadEntryData(&send_buffer[send_buffer_size], send_threshold - send_buffer_size);
                         bytes_left -= send_threshold - send_buffer_size;
                         send_buffer_size = send_threshold;
                     }
                     SendBuffer(s);
+                    Timeline::Shared().Instant("yield", "coroutine");
                     send_routine->yield();
+                    UpdateThreshold(s);
                     bytes_sent += send_buffer_size;
-                    std::cout << "\r[" << file_count << "/" << entries.size() << "]: Uploading " << iter.first
-                         << " ... [" << bytes_sent << "/" << file_header.comp_size << "] " << std::flush;
+                    std::cout << "\r[" << file_count << "/" << send_count << "]: Uploading " << name
+                         << " ... [" << bytes_sent << "/" << csize << "] " << std::flush;
                     send_buffer_size = 0;
                 }
             }
+            Timeline::Shared().AsyncEnd("entry", "install", file_count);
             file_count++;
             std::cout << "done." << std::endl;
         }
+        if(patch_mode) {
+            for(auto& name : removed_entries) {
+                if(send_buffer_size + name.length() + 19 > send_threshold) {
+                    SendBuffer(s);
+                    Timeline::Shared().Instant("yield", "coroutine");
+                    send_routine->yield();
+                    UpdateThreshold(s);
+                    send_buffer_size = 0;
+                }
+                PutRecordHeader(name.c_str(), name.length(), -1);
+                std::cout << "Removing " << name << std::endl;
+            }
+        }
         if(send_buffer_size)
             SendBuffer(s);
-        VTP_INSTALL_VPK_END ve;
-        s.Send(&ve, 4);
+        VTP_INSTALL_VPK_END::Send(s);
+        end_sent = true;
     }
-    
-    void InitSend(Sender& s) {
-        VTP_INSTALL_VPK iv;
-        iv.hdr.length = sizeof(iv);
-        iv.total_size_l = (total_size & 0xffffffff);
-        iv.total_size_h = (total_size >> 32);
-        iv.flag = 0;
-        
-        // check permission
-        auto& inf = entries["eboot.bin"];
+
+    // read and inflate a whole (small) entry
+    bool ReadEntry(const std::string& name, std::vector<uint8_t>& out) {
+        size_t idx = entries.Find(name);
+        if(idx == ZipEntryTable::npos)
+            return false;
+        ZipFileInfo inf = entries.Info(idx);
+        std::vector<uint8_t> raw(inf.comp_size);
+        zip_file.seekg(inf.data_start, zip_file.beg);
+        zip_file.read((char*)raw.data(), inf.comp_size);
+        if(!zip_file) {
+            zip_file.clear();
+            return false;
+        }
+        if(!inf.compressed) {
+            out.swap(raw);
+            return true;
+        }
+        out.resize(inf.file_size);
+        z_stream estr;
+        memset(&estr, 0, sizeof(estr));
+        inflateInit2(&estr, -15);
+        estr.next_in = raw.data();
+        estr.avail_in = raw.size();
+        estr.next_out = out.data();
+        estr.avail_out = out.size();
+        int32_t res = inflate(&estr, Z_FINISH);
+        inflateEnd(&estr);
+        return res == Z_STREAM_END;
+    }
+
+    // TITLE_ID from sce_sys/param.sfo, names the install manifest
+    std::string ReadTitleId() {
+        std::vector<uint8_t> sfo;
+        if(!ReadEntry("sce_sys/param.sfo", sfo))
+            return "";
+        return sfo_title_id(sfo);
+    }
+
+    // the manifest of the last install is recorded for every device,
+    // patch mode sends only entries changed since then
+    void SetDevice(const std::string& dev, bool patch) {
+        device = dev;
+        if(!title_id.empty())
+            manifest.Load(device, title_id);
+        patch_mode = patch && !manifest.entries.empty();
+        if(patch && !patch_mode)
+            std::cout << "no install manifest for " << (title_id.empty() ? "this vpk" : title_id) << ", sending everything." << std::endl;
+        if(!patch_mode)
+            return;
+        total_size = 0;
+        for(size_t i = 0; i < entries.Size(); ++i)
+            if(IsChanged(i))
+                total_size += entries.comp_size[i];
+        for(auto& iter : manifest.entries)
+            if(iter.first.length() <= max_entry_name && entries.Find(iter.first) == ZipEntryTable::npos)
+                removed_entries.push_back(iter.first);
+    }
+
+    // deflate stored entries on all cores while connecting, they are sent deflated only if that saves bytes
+    void EnableDeflate(int32_t thread_count, int32_t level) {
+        static const size_t min_entry_size = 64 * 1024;
+        deflate_pool = new DeflatePool();
+        size_t job_count = 0;
+        for(size_t i = 0; i < entries.Size(); ++i) {
+            if(entries.compressed[i] || entries.comp_size[i] < min_entry_size || !IsChanged(i))
+                continue;
+            entries.deflate_job[i] = deflate_pool->AddJob(entries.data_start[i], entries.comp_size[i]);
+            job_count++;
+        }
+        if(job_count == 0 || !deflate_pool->Start(zip_path, thread_count, level)) {
+            std::fill(entries.deflate_job.begin(), entries.deflate_job.end(), -1);
+            delete deflate_pool;
+            deflate_pool = nullptr;
+        }
+    }
+
+    // the install header carries the total size, so every recompression has to be decided before it is sent.
+    // total_size stays the stored total, deflated_size is what goes out with the recompressed entries
+    void ResolveDeflate() {
+        deflate_pool->Wait();
+        size_t saved = 0;
+        size_t count = 0;
+        deflated_size = total_size;
+        for(size_t i = 0; i < entries.Size(); ++i) {
+            if(entries.deflate_job[i] < 0)
+                continue;
+            auto& job = deflate_pool->GetJob(entries.deflate_job[i]);
+            if(job.comp_size + entries.comp_size[i] / 32 >= entries.comp_size[i]) {
+                entries.deflate_job[i] = -1;
+                continue;
+            }
+            saved += entries.comp_size[i] - job.comp_size;
+            deflated_size -= entries.comp_size[i] - job.comp_size;
+            count++;
+        }
+        std::cout << "recompressed " << count << " stored entries, " << saved << " bytes saved." << std::endl;
+    }
+
+    // system apps (authid 0x2F00000000000001/3) need extra permission on install
+    // reads through its own stream so it can run beside the rest of Load
+    uint32_t InspectEboot(std::istream& f, const ZipFileInfo& inf) {
         ZipFileHeader file_header;
-        zip_file.seekg(inf.data_offset, zip_file.beg);
-        zip_file.read((char*)&file_header, ZIP_FILE_SIZE);
-        zip_file.seekg(file_header.name_size + file_header.ex_size, zip_file.cur);
+        f.seekg(inf.data_offset, f.beg);
+        f.read((char*)&file_header, ZIP_FILE_SIZE);
+        if(!f || file_header.block_header != 0x04034b50)
+            return 0;
+        f.seekg(file_header.name_size + file_header.ex_size, f.cur);
         uint8_t ebuf[1024];
         uint8_t dbuf[256];
+        memset(dbuf, 0, sizeof(dbuf));
         if(inf.compressed) {
-            zip_file.read((char*)ebuf, 1024);
+            f.read((char*)ebuf, inf.comp_size < 1024 ? inf.comp_size : 1024);
             z_stream estr;
             memset(&estr, 0, sizeof(estr));
             inflateInit2(&estr, -15);
             estr.next_in = ebuf;
-            estr.avail_in = 1024;
+            estr.avail_in = f.gcount();
             estr.avail_out = 256;
             estr.next_out = dbuf;
             inflate(&estr, Z_NO_FLUSH);
             inflateEnd(&estr);
         } else {
-            zip_file.read((char*)dbuf, 256);
+            f.read((char*)dbuf, inf.comp_size < 256 ? inf.comp_size : 256);
         }
+        f.clear();
         uint64_t authid = *(uint64_t *)(dbuf + 0x80);
         if (authid == 0x2F00000000000001 || authid == 0x2F00000000000003)
-            iv.flag = 0x8;
-        s.Send(&iv, iv.hdr.length);
+            return 0x8;
+        return 0;
+    }
+
+    int32_t InitSend(Sender& s) {
+        if(stream_cached) {
+            install_flag = stream_cache.Flag() & (headers_first ? ~0u : ~0x40u);
+            int64_t cached_size = stream_cache.TotalSize();
+            VTP_INSTALL_VPK::Send(s, cached_size & 0xffffffff, cached_size >> 32, install_flag);
+            return 0;
+        }
+        install_flag = auth_flag;
+        announced_size = total_size;
+        if(patch_mode)
+            install_flag |= 0x10;
+        if(deflate_pool) {
+            ResolveDeflate();
+            install_flag |= 0x20;
+            announced_size = deflated_size;
+        }
+        if(headers_first)
+            install_flag |= 0x40;
+        VTP_INSTALL_VPK::Send(s, announced_size & 0xffffffff, announced_size >> 32, install_flag);
+        return 0;
+    }
+
+    // ends an install the device accepted but will not get (the rest of) its content for, the device
+    // fails the end and the connection is ready for the next install once that reply is in
+    void CancelInstall(Sender& s) {
+        cancelled = true;
+        if(!end_sent)
+            VTP_INSTALL_VPK_END::Send(s);
+        end_sent = true;
+    }
+
+    // drops whatever is still sending, between windows so the stream stays on a packet boundary.
+    // the coroutine is deleted where it waits for an ack, its frame holds nothing to unwind
+    void StopSending() {
+        if(pipeline) {
+            pipeline->Stop();
+            PrintProgress();
+            end_sent = end_sent || pipeline->Ended();
+            delete pipeline;
+            pipeline = nullptr;
+        }
+        if(send_routine) {
+            delete send_routine;
+            send_routine = nullptr;
+        }
+        BufferPool::Shared().Release(send_stack, 0x10000);
+        BufferPool::Shared().Release(send_buffer, send_buffer_capacity);
+        send_stack = nullptr;
+        send_buffer = nullptr;
+        send_buffer_capacity = 0;
+        send_limit = 0;
+    }
+
+    // one window straight from the stream cache, the last one is followed by the end without waiting.
+    // false after a short send, the device holds a cut packet and the session cannot go on
+    bool SendCachedWindow(Sender& s) {
+        uint64_t window = s.WindowSize(default_send_threshold) & ~(uint64_t)1023;
+        uint64_t end = std::min<uint64_t>(cache_pos + window, stream_cache.PayloadSize());
+        uint64_t offset = stream_cache.FileOffset(cache_pos);
+        s.BeginWindow();
+        size_t length = stream_cache.FileOffset(end) - offset;
+        size_t sent = s.SendFile(stream_cache.Fd(), offset, length);
+        if(sent != length) {
+            s.EndWindow(0);
+            broken = true;
+            std::cout << "failed, sent " << sent << " of " << length << " bytes." << std::endl;
+            return false;
+        }
+        VTP_VPK_PAUSE::Send(s);
+        s.EndWindow(end - cache_pos);
+        cache_pos = end;
+        if(cache_pos == stream_cache.PayloadSize()) {
+            VTP_INSTALL_VPK_END::Send(s);
+            end_sent = true;
+            std::cout << "done." << std::endl;
+        }
+        return true;
     }
     
     int32_t HandlePacket(Sender& s, short type, void* data, int32_t length) {
         switch(type) {
             case 0x20: {
-                int32_t result = *(int32_t*)data;
+                VTRP_INSTALL_VPK::View reply(data, length);
+                int32_t result = reply.Get<0>();
                 if(result != 0) {
                     if(result == 1)
                         std::cout << "Not finished yet." << std::endl;
@@ -284,46 +905,200 @@ public:
                         std::cout << "Unknown error." << std::endl;
                     return 1;
                 }
-                if(send_routine)
+                if(send_routine || pipeline || cache_pos)
+                    break;
+                // devices without patch support do not echo the flag back
+                uint32_t accepted = reply.Get<1>();
+                // the cached stream holds recompressed entries and was announced with their total
+                if(stream_cached && (install_flag & 0x20) && !(accepted & 0x20)) {
+                    std::cout << "device does not support recompressed entries, install again without --deflate." << std::endl;
+                    CancelInstall(s);
+                    break;
+                }
+                if(stream_cached) {
+                    std::cout << "sending the cached install stream (" << stream_cache.PayloadSize() << " bytes) ... " << std::flush;
+                    if(!SendCachedWindow(s))
+                        return 1;
+                    break;
+                }
+                // the announced total counts only the patch, sending everything would not match it
+                if(patch_mode && !(accepted & 0x10)) {
+                    std::cout << "device does not support patch install, install again without --patch." << std::endl;
+                    CancelInstall(s);
+                    break;
+                }
+                // the same for recompressed entries, the stored ones would not add up to the announced total
+                if((install_flag & 0x20) && !(accepted & 0x20)) {
+                    std::cout << "device does not support recompressed entries, install again without --deflate." << std::endl;
+                    CancelInstall(s);
+                    break;
+                }
+                // recorded with the flags the device accepted, a cached stream is only served the same way
+                if(stream_cache_mode && !patch_mode)
+                    stream_cache.Create(index_key, stream_level, announced_size, (install_flag & 0xf) | (install_flag & accepted & 0xf0));
+                OrderEntries((accepted & 0x40) != 0);
+                if(pipeline_mode) {
+                    stream_total = 0;
+                    for(size_t i = 0; i < entries.Size(); ++i)
+                        if(IsChanged(i))
+                            stream_total++;
+                    stream_pos = 0;
+                    pipeline = new InstallPipeline();
+                    pipeline->Start(s, [this](uint8_t* dst, size_t size) { return ReadStream(dst, size); }, default_send_threshold, true, WindowLimit());
                     break;
+                }
                 auto co_fun = [this, &s](cotiny::Coroutine<>* co, int32_t arg) {
                     SendAll(s);
                 };
-                send_buffer = new uint8_t[3 * 1024 * 1024];
-                send_routine = new cotiny::Coroutine<>(co_fun, 0x10000);
-                send_routine->resume();
+                // the stack first, it is small and the send buffer shrinks to whatever the cap leaves.
+                // the buffer covers the current window and grows with it
+                send_stack = BufferPool::Shared().Acquire(0x10000);
+                send_limit = 0;
+                UpdateThreshold(s);
+                send_routine = new cotiny::Coroutine<>(co_fun, 0x10000, send_stack, false);
+                ResumeSend();
                 break;
             }
             case 0x21: {
+                Timeline::Shared().Instant("ack", "net");
+                if(cancelled)
+                    break;
+                if(stream_cached) {
+                    // the ack of the last window comes after the end was sent
+                    s.WindowAcked();
+                    if(cache_pos < stream_cache.PayloadSize() && !SendCachedWindow(s))
+                        return 1;
+                    break;
+                }
+                if(pipeline) {
+                    pipeline->Credit();
+                    PrintProgress();
+                    break;
+                }
+                s.WindowAcked();
                 if(send_routine)
-                    send_routine->resume();
+                    ResumeSend();
                 break;
             }
             case 0x22: {
-                int32_t result = *(int32_t*)data;
+                int32_t result = VTRP_INSTALL_VPK_END::View(data, length).Get<0>();
+                if(pipeline) {
+                    pipeline->Stop();
+                    PrintProgress();
+                }
+                // the title was never touched, its manifest stays valid
+                if(cancelled)
+                    return 1;
                 if(result != 0) {
-                    if(result == 1)
-                        std::cout << "makeHeadBin() error." << std::endl;
-                    else if(result == 2)
-                        std::cout << "promote() error." << std::endl;
-                    else
-                        std::cout << "Unknown error." << std::endl;
-                } else
+                    std::cout << EndError(result) << std::endl;
+                    if(!device.empty() && !title_id.empty())
+                        manifest.Remove();
+                } else {
                     std::cout << "install success." << std::endl;
+                    succeeded = true;
+                    if(stream_cache.Writing() && stream_cache.Commit())
+                        std::cout << "install stream cached for the next install." << std::endl;
+                    if(!title_id.empty() && !device.empty()) {
+                        manifest.entries.clear();
+                        for(size_t i = 0; i < entries.Size(); ++i) {
+                            ManifestEntry& ent = manifest.entries[entries.Name(i)];
+                            ent.crc32 = entries.crc32[i];
+                            ent.file_size = entries.file_size[i];
+                        }
+                        manifest.Save();
+                    }
+                }
                 return 1;
                 break;
             }
+            case 0x23: {
+                // the device found eboot.bin or sce_sys/ broken and dropped the install, it ignores the content
+                // still in flight until the end. the installed title is untouched so its manifest stays valid
+                int32_t result = VTRP_INSTALL_VPK_ABORT::View(data, length).Get<0>();
+                Timeline::Shared().Instant("abort", "net");
+                if(cancelled)
+                    break;
+                StopSending();
+                std::cout << std::endl << "device rejected the package early: " << EndError(result) << std::endl;
+                CancelInstall(s);
+                break;
+            }
         }
         return 0;
     }
     
 protected:
+    static const char* EndError(int32_t result) {
+        if(result == 1)
+            return "makeHeadBin() error.";
+        if(result == 2)
+            return "promote() error.";
+        return "Unknown error.";
+    }
+
+    static const uint32_t index_magic = 0x5849564d; // "MVIX"
+    static const uint32_t index_version = 3;
     std::ifstream zip_file;
+    std::string zip_path;
+    DeflatePool* deflate_pool = nullptr;
+    DeflateJob* read_job = nullptr;
+    uint32_t read_segment = 0;
+    uint32_t read_offset = 0;
     int64_t total_size = 0;
-    std::unordered_map<std::string, ZipFileInfo> entries;
+    int64_t deflated_size = 0;
+    int64_t announced_size = 0;
+    uint32_t auth_flag = 0;
+    double eboot_time = 0.0;
+    std::string title_id;
+    std::string device;
+    bool patch_mode = false;
+    InstallManifest manifest;
+    std::vector<std::string> removed_entries;
+    ZipEntryTable entries;
+    ZipIndexKey index_key;
+    std::string index_path;
     cotiny::Coroutine<>* send_routine = nullptr;
+    // the largest window plus room for one record header
+    static const uint32_t default_send_threshold = WindowController::default_window;
+    static const uint32_t max_send_threshold = WindowController::max_window;
+    static const uint32_t record_slack = 64 * 1024;
+    // the record nlen (name plus the 13 byte ux0:ptmp/pkg/ prefix) must stay below 0x8000
+    static const size_t max_entry_name = 0x7fff - 13;
+    static const uint32_t min_send_buffer = 256 * 1024;
+    void* send_stack = nullptr;
     uint8_t* send_buffer = nullptr;
+    size_t send_buffer_capacity = 0;
+    uint32_t send_threshold = default_send_threshold;
+    uint32_t send_limit = 0;
+    std::vector<iovec> send_iov;
+    pkt_base vc_full = VTP_VPK_CONTENT::Header(1024);
+    pkt_base vc_last = VTP_VPK_CONTENT::Header(0);
+    pkt_base vc_pause = VTP_VPK_PAUSE::Header(0);
     uint32_t send_buffer_size = 0;
+    typedef SendPipeline<VTP_VPK_CONTENT, VTP_VPK_PAUSE, VTP_INSTALL_VPK_END> InstallPipeline;
+    bool pipeline_mode = false;
+    bool succeeded = false;
+    bool broken = false;
+    bool cancelled = false;
+    bool end_sent = false;
+    bool headers_first = true;
+    InstallPipeline* pipeline = nullptr;
+    std::vector<uint32_t> send_order;
+    uint32_t install_flag = 0;
+    bool stream_cache_mode = false;
+    bool stream_cached = false;
+    int32_t stream_level = 0;
+    uint64_t cache_pos = 0;
+    StreamCache stream_cache;
+    size_t stream_pos = 0;
+    std::vector<uint8_t> stream_head;
+    size_t stream_head_pos = 0;
+    size_t stream_left = 0;
+    size_t stream_removed = 0;
+    size_t stream_count = 0;
+    size_t stream_total = 0;
+    std::mutex progress_mutex;
+    std::string progress_text;
 };
 
 #endif
@@ -0,0 +1,81 @@
+#ifndef _INSTALL_MANIFEST_H_
+#define _INSTALL_MANIFEST_H_
+
+#include <map>
+
+#include "common.h"
+
+struct ManifestEntry {
+    uint32_t crc32 = 0;
+    uint64_t file_size = 0;
+};
+
+// what was last installed for a title on a device, used to build patch installs
+class InstallManifest {
+public:
+    bool Load(const std::string& device, const std::string& title_id) {
+        file_path = cache_path("install_" + device + "_" + title_id + ".manifest");
+        entries.clear();
+        std::ifstream f(file_path, std::ios::in | std::ios::binary);
+        if(!f)
+            return false;
+        uint32_t magic = 0, count = 0;
+        f.read((char*)&magic, 4);
+        if(magic != manifest_magic)
+            return false;
+        f.read((char*)&count, 4);
+        for(uint32_t i = 0; i < count && f; ++i) {
+            std::string name = read_string(f);
+            ManifestEntry& ent = entries[name];
+            f.read((char*)&ent.crc32, 4);
+            f.read((char*)&ent.file_size, 8);
+        }
+        if(!f) {
+            entries.clear();
+            return false;
+        }
+        return true;
+    }
+
+    bool Save() {
+        std::string tmp_path = file_path + ".tmp";
+        std::ofstream f(tmp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if(!f)
+            return false;
+        uint32_t magic = manifest_magic;
+        uint32_t count = entries.size();
+        f.write((const char*)&magic, 4);
+        f.write((const char*)&count, 4);
+        for(auto& iter : entries) {
+            write_string(f, iter.first);
+            f.write((const char*)&iter.second.crc32, 4);
+            f.write((const char*)&iter.second.file_size, 8);
+        }
+        f.close();
+        if(!f)
+            return false;
+        return rename(tmp_path.c_str(), file_path.c_str()) == 0;
+    }
+
+    // the device state is unknown after a failed install
+    void Remove() {
+        entries.clear();
+        unlink(file_path.c_str());
+    }
+
+    // the key is built in a reused buffer, a check per entry allocates nothing once it has grown
+    bool IsChanged(const char* name, size_t len, uint32_t crc32, uint64_t file_size) {
+        lookup_key.assign(name, len);
+        auto iter = entries.find(lookup_key);
+        return iter == entries.end() || iter->second.crc32 != crc32 || iter->second.file_size != file_size;
+    }
+
+    std::map<std::string, ManifestEntry> entries;
+
+protected:
+    static const uint32_t manifest_magic = 0x464d564d; // "MVMF"
+    std::string file_path;
+    std::string lookup_key;
+};
+
+#endif
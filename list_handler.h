@@ -0,0 +1,123 @@
+#ifndef _LIST_HANDLER_H_
+#define _LIST_HANDLER_H_
+
+#include "common.h"
+#include "remote_cache.h"
+
+class ListHandler : public PacketHandler {
+public:
+    bool Load(const std::string& device, const std::string& remote_dir) {
+        vita_path = RemoteCache::NormalizePath(remote_dir);
+        if(!VTP_LIST_DIR::Fits(vita_path.length() + 1)) {
+            std::cout << "remote path " << vita_path << " is too long." << std::endl;
+            return false;
+        }
+        cache.Load(device);
+        return true;
+    }
+
+    // a listing for another handler prints nothing, the caller reads Result and the cache
+    void SetQuiet(bool on) {
+        quiet = on;
+    }
+
+    // 0 once the listing is complete, -1 while incomplete, otherwise the device result
+    int32_t Result() {
+        return result;
+    }
+
+    RemoteCache& Cache() {
+        return cache;
+    }
+
+    // answer from the local cache without touching the device
+    bool PrintCached() {
+        if(!cache.IsCovered(vita_path))
+            return false;
+        PrintListing();
+        return true;
+    }
+
+    void PrintListing() {
+        cache.ForEach(vita_path, [](const std::string& path, const RemoteEntry& ent) {
+            std::cout << ent.size << "\t" << ent.mtime << "\t" << path << ((ent.attr & 0x1) ? "/" : "") << "\n";
+        });
+        std::cout << std::flush;
+    }
+
+    int32_t InitSend(Sender& s) {
+        return VTP_LIST_DIR::SendTail(s, vita_path, 0x1) == 0;
+    }
+
+    // records are not aligned to packets, keep the unparsed tail for the next one
+    void ParseRecords(void* data, int32_t length) {
+        pending.insert(pending.end(), (uint8_t*)data, (uint8_t*)data + length);
+        size_t pos = 0;
+        VTP_LIST_ENTRY le;
+        while(pos + sizeof(le) <= pending.size()) {
+            memcpy(&le, &pending[pos], sizeof(le));
+            le.name_size = wire_order(le.name_size);
+            if(pos + sizeof(le) + le.name_size > pending.size())
+                break;
+            std::string name((const char*)&pending[pos + sizeof(le)], le.name_size);
+            RemoteEntry ent;
+            ent.size = ((uint64_t)wire_order(le.size_h) << 32) | wire_order(le.size_l);
+            ent.mtime = wire_order(le.mtime);
+            ent.attr = wire_order(le.attr);
+            cache.AddEntry(RemoteCache::JoinPath(vita_path, name), ent);
+            pos += sizeof(le) + le.name_size;
+            entry_count++;
+        }
+        pending.erase(pending.begin(), pending.begin() + pos);
+    }
+
+    int32_t HandlePacket(Sender& s, short type, void* data, int32_t length) {
+        switch(type) {
+            case 0x30: {
+                result = VTRP_LIST_DIR::View(data, length).Get<0>();
+                if(result != 0) {
+                    if(quiet)
+                        return 1;
+                    if(result == 1)
+                        std::cout << "Not finished yet." << std::endl;
+                    else if(result == 4)
+                        std::cout << "Cannot open directory." << std::endl;
+                    else
+                        std::cout << "Unknown error." << std::endl;
+                    return 1;
+                }
+                cache.BeginListing(vita_path);
+                result = -1;
+                break;
+            }
+            case 0x31: {
+                ParseRecords(data, length);
+                break;
+            }
+            case 0x32: {
+                if(!pending.empty()) {
+                    std::cout << "listing truncated." << std::endl;
+                    return 1;
+                }
+                cache.EndListing(vita_path);
+                cache.Save();
+                result = 0;
+                if(!quiet)
+                    PrintListing();
+                return 1;
+                break;
+            }
+        }
+        return 0;
+    }
+
+protected:
+    size_t entry_count = 0;
+    int32_t result = -1;
+    bool quiet = false;
+    std::string vita_path;
+    std::vector<uint8_t> pending;
+    RemoteCache cache;
+};
+
+#endif
@@ -0,0 +1,425 @@
+#ifndef _NET_TUNING_H_
+#define _NET_TUNING_H_
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#endif
+
+#include "common.h"
+
+// connects in the background with a timeout so local preparation can run meanwhile
+class Connector {
+public:
+    // a connect nobody waited for is cancelled, a failed load must not hang for the timeout
+    ~Connector() {
+        Cancel();
+    }
+
+    void Start(const sockaddr_in& addr, int32_t timeout_ms) {
+        begin = std::chrono::steady_clock::now();
+        if(pipe(cancel_pipe) != 0)
+            cancel_pipe[0] = cancel_pipe[1] = -1;
+        worker = std::thread([this, addr, timeout_ms]() {
+            sock = Connect(addr, timeout_ms, cancel_pipe[0]);
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        });
+    }
+
+    // stops a pending connect and closes the socket if it already went through
+    void Cancel() {
+        if(cancel_pipe[1] >= 0) {
+            char c = 0;
+            if(write(cancel_pipe[1], &c, 1) != 1)
+                std::cout << "cannot cancel the connect." << std::endl;
+        }
+        if(worker.joinable())
+            worker.join();
+        if(sock >= 0)
+            close(sock);
+        sock = -1;
+        ClosePipe();
+    }
+
+    // the connected socket in blocking mode, -1 on failure or timeout
+    int32_t Wait() {
+        if(worker.joinable())
+            worker.join();
+        ClosePipe();
+        int32_t res = sock;
+        sock = -1;
+        return res;
+    }
+
+    bool Started() {
+        return worker.joinable();
+    }
+
+    double Elapsed() {
+        return elapsed;
+    }
+
+protected:
+    static int32_t Connect(const sockaddr_in& addr, int32_t timeout_ms, int32_t cancel_fd) {
+        int32_t s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if(s < 0)
+            return -1;
+        int32_t fl = fcntl(s, F_GETFL, 0);
+        fcntl(s, F_SETFL, fl | O_NONBLOCK);
+        int32_t res = connect(s, (const sockaddr*)&addr, sizeof(addr));
+        if(res != 0 && errno == EINPROGRESS) {
+            pollfd pfd[2] = {{s, POLLOUT, 0}, {cancel_fd, POLLIN, 0}};
+            int32_t err = 0;
+            socklen_t len = sizeof(err);
+            if(poll(pfd, cancel_fd >= 0 ? 2 : 1, timeout_ms) > 0 && !(pfd[1].revents & POLLIN) && (pfd[0].revents & POLLOUT)
+                && getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+                res = 0;
+        }
+        if(res != 0) {
+            close(s);
+            return -1;
+        }
+        fcntl(s, F_SETFL, fl);
+        return s;
+    }
+
+    void ClosePipe() {
+        for(int32_t i = 0; i < 2; ++i) {
+            if(cancel_pipe[i] >= 0)
+                close(cancel_pipe[i]);
+            cancel_pipe[i] = -1;
+        }
+    }
+
+    std::thread worker;
+    int32_t cancel_pipe[2] = {-1, -1};
+    std::chrono::steady_clock::time_point begin;
+    double elapsed = 0.0;
+    int32_t sock = -1;
+};
+
+// sizes the upload window (bytes before each pause) from how long the device takes to ack it.
+// the stall (pause to ack, less the time the socket still needed to drain) is the round trip
+// plus the time the device needs to flush the window to the card. the round trip comes from the
+// kernel (tcpi_rtt), the rest is the flush:
+// - a flush above max_stall means the device is flush-bound, the window shrinks to fit it
+// - a stall that is a large share of the window cycle while the flush stays short means the link
+//   is fast and the fixed latency dominates, the window grows
+// the size is read by the framer thread of a pipeline, so it is atomic
+class WindowController {
+public:
+    static const size_t default_window = 2 * 1024 * 1024;
+    static const size_t min_window = 256 * 1024;
+    static const size_t max_window = 8 * 1024 * 1024;
+
+    // a fixed size turns the adaptation off, it is kept within the adaptive range
+    void SetFixed(size_t size) {
+        fixed = size != 0;
+        if(!fixed)
+            return;
+        window = Clamp(size);
+        smallest = largest = Window();
+    }
+
+    size_t Window() {
+        return window.load(std::memory_order_relaxed);
+    }
+
+    // cycle runs from the first byte of the window to its ack, rtt is the kernel's (0 when unknown)
+    void WindowAcked(size_t bytes, double cycle, double stall, double rtt) {
+        if(stall < 0.0)
+            stall = 0.0;
+        stall_sum += stall;
+        stall_count++;
+        if(rtt > 0.0)
+            round_trip = rtt;
+        // a short last window says nothing about the device
+        if(fixed || bytes < Window() / 2)
+            return;
+        size_t size = Window();
+        double flush = stall > round_trip ? stall - round_trip : 0.0;
+        if(flush > max_stall)
+            size = (size_t)(size * (max_stall / flush));
+        else if(flush < max_stall / 2 && stall > cycle * 0.25)
+            size = size * 3 / 2;
+        size = Clamp(size);
+        window.store(size, std::memory_order_relaxed);
+        smallest = std::min(smallest, size);
+        largest = std::max(largest, size);
+    }
+
+    void Report() {
+        if(stall_count == 0)
+            return;
+        std::cout << "window: " << Window() << " bytes" << (fixed ? " (fixed)" : "")
+            << ", range " << smallest << "-" << largest
+            << ", ack stall avg " << stall_sum / stall_count * 1000.0 << " ms (rtt " << round_trip * 1000.0
+            << " ms) over " << stall_count << " windows" << std::endl;
+    }
+
+protected:
+    static size_t Clamp(size_t size) {
+        size = size < min_window ? min_window : (size > max_window ? max_window : size);
+        return size & ~(size_t)1023;
+    }
+
+    // longest the device may take to ack a window before it counts as flush-bound
+    static constexpr double max_stall = 0.25;
+    std::atomic<size_t> window{default_window};
+    bool fixed = false;
+    size_t smallest = default_window;
+    size_t largest = default_window;
+    double stall_sum = 0.0;
+    double round_trip = 0.0;
+    size_t stall_count = 0;
+};
+
+// socket options follow what the window/ack exchange shows about the link:
+// - TCP_NODELAY so pause markers and acks never wait for Nagle, TCP_CORK while a window is written
+// - SO_SNDBUF/SO_RCVBUF set to twice the bandwidth-delay product, only when that is beyond the
+//   kernel's autotuning (tcp_wmem/tcp_rmem max): a set buffer is no longer autotuned
+// - MSG_ZEROCOPY for large gathered writes, dropped again when the kernel keeps copying
+class TransportTuner {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    static const size_t min_buffer = 256 * 1024;
+    static const size_t max_buffer = 16 * 1024 * 1024;
+    static const size_t zerocopy_threshold = 64 * 1024;
+
+    void Attach(int32_t s) {
+        sock = s;
+        int32_t on = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        socklen_t len = sizeof(int32_t);
+        int32_t val = 0;
+        if(getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &val, &len) == 0)
+            snd_buffer = val / 2;
+        len = sizeof(int32_t);
+        if(getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &val, &len) == 0)
+            rcv_buffer = val / 2;
+#ifdef __linux__
+        snd_autotune_max = AutotuneMax("/proc/sys/net/ipv4/tcp_wmem");
+        rcv_autotune_max = AutotuneMax("/proc/sys/net/ipv4/tcp_rmem");
+#endif
+#if defined(__linux__) && defined(SO_ZEROCOPY)
+        zerocopy = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+#endif
+    }
+
+    void Cork(bool on) {
+#ifdef TCP_CORK
+        int32_t val = on ? 1 : 0;
+        setsockopt(sock, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+#endif
+    }
+
+    // we start writing a window
+    void BeginWindow() {
+        sending = true;
+        window_begin = clock::now();
+        window_open = true;
+        Cork(true);
+    }
+
+    // our ack let the device send the next window of a download
+    void WindowReleased() {
+        sending = false;
+        window_begin = clock::now();
+        window_open = true;
+    }
+
+    // the pause marker is out, or the device paused us on a download
+    void EndWindow(size_t bytes) {
+        Cork(false);
+        window_end = clock::now();
+        window_bytes = bytes;
+        unsent_bytes = 0;
+#ifdef SIOCOUTQ
+        int32_t outq = 0;
+        if(ioctl(sock, SIOCOUTQ, &outq) == 0)
+            unsent_bytes = outq;
+#endif
+        if(!window_open)
+            return;
+        window_open = false;
+        // receiving: the window was released by our ack at window_begin
+        if(!sending)
+            AddSample(bytes, Seconds(window_begin, window_end), KernelRtt());
+    }
+
+    // the device acked a window we sent
+    void WindowAcked() {
+        auto now = clock::now();
+        double elapsed = Seconds(window_begin, now);
+        double rtt = Seconds(window_end, now);
+        // what was still queued in the socket had to drain before the ack could come back
+        if(bandwidth > 0)
+            rtt -= unsent_bytes / bandwidth;
+        AddSample(window_bytes, elapsed, rtt);
+        window.WindowAcked(window_bytes, elapsed, rtt, KernelRtt());
+    }
+
+    size_t SendV(const iovec* iov, int32_t count, bool allow_zerocopy) {
+        size_t total = 0;
+        for(int32_t i = 0; i < count; ++i)
+            total += iov[i].iov_len;
+        std::vector<iovec> vec(iov, iov + count);
+        iovec* cur = vec.data();
+        int32_t left = count;
+        size_t sent = 0;
+        while(left > 0) {
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = cur;
+            msg.msg_iovlen = left < IOV_MAX ? left : IOV_MAX;
+            int32_t flags = 0;
+#ifdef MSG_ZEROCOPY
+            if(allow_zerocopy && zerocopy && total >= zerocopy_threshold)
+                flags |= MSG_ZEROCOPY;
+#endif
+            ssize_t res = sendmsg(sock, &msg, flags);
+            if(res < 0 && flags && errno == ENOBUFS)
+                res = sendmsg(sock, &msg, 0);
+            if(res <= 0)
+                break;
+            if(flags)
+                zerocopy_sends++;
+            sent += res;
+            while(left > 0 && (size_t)res >= cur->iov_len) {
+                res -= cur->iov_len;
+                cur++;
+                left--;
+            }
+            if(left > 0) {
+                cur->iov_base = (uint8_t*)cur->iov_base + res;
+                cur->iov_len -= res;
+            }
+        }
+        ReapCompletions();
+        return sent;
+    }
+
+    void Report() {
+        std::cout << "transport: rtt " << (rtt_min > 0 ? rtt_min * 1000.0 : KernelRtt() * 1000.0) << " ms"
+            << ", bandwidth " << bandwidth / (1024.0 * 1024.0) << " MB/s"
+            << ", bdp " << (size_t)(bandwidth * rtt_min) << " bytes"
+            << ", SO_SNDBUF " << snd_buffer << ", SO_RCVBUF " << rcv_buffer
+            << ", TCP_NODELAY on, TCP_CORK per window"
+            << ", zerocopy " << (zerocopy ? "on" : "off") << " (" << zerocopy_sends << " sends, " << zerocopy_copied << " copied)"
+            << std::endl;
+        window.Report();
+    }
+
+    WindowController window;
+
+protected:
+    static double Seconds(clock::time_point from, clock::time_point to) {
+        return std::chrono::duration<double>(to - from).count();
+    }
+
+    double KernelRtt() {
+#if defined(__linux__) && defined(TCP_INFO)
+        tcp_info info;
+        socklen_t len = sizeof(info);
+        if(getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+            return (info.tcpi_rtt ? info.tcpi_rtt : info.tcpi_rcv_rtt) / 1000000.0;
+#endif
+        return 0.0;
+    }
+
+    // third field of tcp_wmem/tcp_rmem, 0 when unknown (nothing is set then)
+    static size_t AutotuneMax(const char* path) {
+        std::ifstream f(path);
+        size_t low = 0, def = 0, high = 0;
+        if(!(f >> low >> def >> high))
+            return 0;
+        return high;
+    }
+
+    void AddSample(size_t bytes, double elapsed, double rtt) {
+        if(elapsed <= 0.0)
+            return;
+        double bw = bytes / elapsed;
+        bandwidth = (bandwidth == 0.0) ? bw : bandwidth * 0.75 + bw * 0.25;
+        if(rtt > 0.0 && (rtt_min == 0.0 || rtt < rtt_min))
+            rtt_min = rtt;
+        if(rtt_min == 0.0)
+            return;
+        size_t target = (size_t)(bandwidth * rtt_min * 2);
+        if(target < min_buffer)
+            target = min_buffer;
+        if(target > max_buffer)
+            target = max_buffer;
+        // only grow, shrinking a buffer that works gains nothing. below the autotuning ceiling the
+        // kernel grows it by itself; getsockopt reports twice the size that was set
+        int32_t val = (int32_t)target;
+        socklen_t len = sizeof(val);
+        if(sending && snd_autotune_max && target > snd_autotune_max && target > snd_buffer) {
+            setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val));
+            if(getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &val, &len) == 0)
+                snd_buffer = val / 2;
+        } else if(!sending && rcv_autotune_max && target > rcv_autotune_max && target > rcv_buffer) {
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+            if(getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &val, &len) == 0)
+                rcv_buffer = val / 2;
+        }
+    }
+
+    // zerocopy completions must be drained or the socket runs out of option memory
+    void ReapCompletions() {
+#if defined(__linux__) && defined(SO_EE_ORIGIN_ZEROCOPY)
+        if(!zerocopy)
+            return;
+        while(true) {
+            char control[128];
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if(recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+                break;
+            for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                sock_extended_err* serr = (sock_extended_err*)CMSG_DATA(cm);
+                if(serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                    continue;
+                if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                    zerocopy_copied += serr->ee_data - serr->ee_info + 1;
+            }
+        }
+        // the kernel copied anyway (e.g. loopback or no scatter-gather), the pinning is pure overhead
+        if(zerocopy_sends >= 8 && zerocopy_copied * 2 > zerocopy_sends)
+            zerocopy = false;
+#endif
+    }
+
+    int32_t sock = -1;
+    bool zerocopy = false;
+    bool sending = false;
+    bool window_open = false;
+    size_t zerocopy_sends = 0;
+    size_t zerocopy_copied = 0;
+    size_t snd_buffer = 0;
+    size_t rcv_buffer = 0;
+    size_t snd_autotune_max = 0;
+    size_t rcv_autotune_max = 0;
+    size_t window_bytes = 0;
+    size_t unsent_bytes = 0;
+    double bandwidth = 0.0;
+    double rtt_min = 0.0;
+    clock::time_point window_begin;
+    clock::time_point window_end;
+};
+
+#endif
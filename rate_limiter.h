@@ -0,0 +1,65 @@
+#ifndef _RATE_LIMITER_H_
+#define _RATE_LIMITER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "common.h"
+
+// process wide --rate budget as one token bucket.
+// every command runs its transfers one after another on one connection, so the whole budget
+// belongs to whoever is sending. senders consume in slices of a few packets,
+// which paces the link instead of bursting whole windows
+class RateLimiter {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    static const size_t slice_size = 16 * 1024;
+
+    static RateLimiter& Shared() {
+        static RateLimiter limiter;
+        return limiter;
+    }
+
+    // bytes per second, 0 turns limiting off
+    void SetRate(double bytes_per_sec) {
+        std::unique_lock<std::mutex> lock(limit_mutex);
+        rate = bytes_per_sec;
+        tokens = 0.0;
+        last_fill = clock::now();
+    }
+
+    bool Enabled() {
+        return rate > 0.0;
+    }
+
+    // blocks until bytes may be sent
+    void Consume(size_t bytes) {
+        double wait = 0.0;
+        {
+            std::unique_lock<std::mutex> lock(limit_mutex);
+            if(rate <= 0.0)
+                return;
+            auto now = clock::now();
+            // a burst of 20 ms keeps the pacing smooth without starving on timer slack
+            double burst = std::max<double>(slice_size, rate * 0.02);
+            tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - last_fill).count());
+            last_fill = now;
+            tokens -= bytes;
+            if(tokens < 0.0)
+                wait = -tokens / rate;
+        }
+        if(wait > 0.0)
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+
+protected:
+    std::mutex limit_mutex;
+    double rate = 0.0;
+    double tokens = 0.0;
+    clock::time_point last_fill = clock::now();
+};
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef _REMOTE_CACHE_H_
+#define _REMOTE_CACHE_H_
+
+#include <map>
+#include <set>
+
+#include "common.h"
+
+struct RemoteEntry {
+    uint64_t size = 0;
+    uint32_t mtime = 0;
+    uint32_t attr = 0;
+};
+
+// metadata of remote trees, one cache file per device
+// a directory in listed_dirs has been listed recursively and every path below it is in entries
+class RemoteCache {
+public:
+    static std::string JoinPath(const std::string& dir, const std::string& name) {
+        if(dir.empty() || dir.back() == ':' || dir.back() == '/')
+            return dir + name;
+        return dir + "/" + name;
+    }
+
+    static std::string NormalizePath(const std::string& path) {
+        std::string p = path;
+        while(p.length() > 1 && p.back() == '/' && p[p.length() - 2] != ':')
+            p.pop_back();
+        return p;
+    }
+
+    static bool IsBelow(const std::string& dir, const std::string& path) {
+        if(path.compare(0, dir.length(), dir) != 0)
+            return false;
+        if(path.length() == dir.length())
+            return true;
+        return dir.back() == ':' || dir.back() == '/' || path[dir.length()] == '/';
+    }
+
+    // drop every listing that may contain remote_path, used before we modify the device
+    static void InvalidatePath(const std::string& device, const std::string& remote_path) {
+        RemoteCache cache;
+        if(!cache.Load(device))
+            return;
+        cache.Invalidate(remote_path);
+        cache.Save();
+    }
+
+    bool Load(const std::string& device) {
+        file_path = cache_path("remote_" + device + ".cache");
+        listed_dirs.clear();
+        entries.clear();
+        std::ifstream f(file_path, std::ios::in | std::ios::binary);
+        if(!f)
+            return false;
+        uint32_t magic = 0, count = 0;
+        f.read((char*)&magic, 4);
+        if(magic != cache_magic)
+            return false;
+        f.read((char*)&count, 4);
+        for(uint32_t i = 0; i < count && f; ++i)
+            listed_dirs.insert(read_string(f));
+        f.read((char*)&count, 4);
+        for(uint32_t i = 0; i < count && f; ++i) {
+            std::string name = read_string(f);
+            RemoteEntry& ent = entries[name];
+            f.read((char*)&ent.size, 8);
+            f.read((char*)&ent.mtime, 4);
+            f.read((char*)&ent.attr, 4);
+        }
+        if(!f) {
+            listed_dirs.clear();
+            entries.clear();
+            return false;
+        }
+        return true;
+    }
+
+    bool Save() {
+        std::string tmp_path = file_path + ".tmp";
+        std::ofstream f(tmp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if(!f)
+            return false;
+        uint32_t magic = cache_magic;
+        uint32_t count = listed_dirs.size();
+        f.write((const char*)&magic, 4);
+        f.write((const char*)&count, 4);
+        for(auto& dir : listed_dirs)
+            write_string(f, dir);
+        count = entries.size();
+        f.write((const char*)&count, 4);
+        for(auto& iter : entries) {
+            write_string(f, iter.first);
+            f.write((const char*)&iter.second.size, 8);
+            f.write((const char*)&iter.second.mtime, 4);
+            f.write((const char*)&iter.second.attr, 4);
+        }
+        f.close();
+        if(!f)
+            return false;
+        return rename(tmp_path.c_str(), file_path.c_str()) == 0;
+    }
+
+    bool IsCovered(const std::string& dir) {
+        std::string p = NormalizePath(dir);
+        for(auto& ldir : listed_dirs)
+            if(IsBelow(ldir, p))
+                return true;
+        return false;
+    }
+
+    // visit every cached path below dir, in sorted order
+    template<typename FUNC>
+    void ForEach(const std::string& dir, FUNC fun) {
+        std::string prefix = ChildPrefix(NormalizePath(dir));
+        for(auto iter = entries.lower_bound(prefix); iter != entries.end(); ++iter) {
+            if(iter->first.compare(0, prefix.length(), prefix) != 0)
+                break;
+            fun(iter->first, iter->second);
+        }
+    }
+
+    void BeginListing(const std::string& dir) {
+        std::string p = NormalizePath(dir);
+        std::string prefix = ChildPrefix(p);
+        auto iter = entries.lower_bound(prefix);
+        while(iter != entries.end() && iter->first.compare(0, prefix.length(), prefix) == 0)
+            iter = entries.erase(iter);
+        for(auto liter = listed_dirs.begin(); liter != listed_dirs.end();) {
+            if(IsBelow(p, *liter))
+                liter = listed_dirs.erase(liter);
+            else
+                ++liter;
+        }
+    }
+
+    void AddEntry(const std::string& path, const RemoteEntry& ent) {
+        entries[path] = ent;
+    }
+
+    void EndListing(const std::string& dir) {
+        listed_dirs.insert(NormalizePath(dir));
+    }
+
+    void Invalidate(const std::string& remote_path) {
+        std::string p = NormalizePath(remote_path);
+        for(auto liter = listed_dirs.begin(); liter != listed_dirs.end();) {
+            if(IsBelow(*liter, p) || IsBelow(p, *liter))
+                liter = listed_dirs.erase(liter);
+            else
+                ++liter;
+        }
+        entries.erase(p);
+    }
+
+protected:
+    // children of a directory sort contiguously after this prefix
+    static std::string ChildPrefix(const std::string& dir) {
+        if(dir.empty() || dir.back() == ':' || dir.back() == '/')
+            return dir;
+        return dir + "/";
+    }
+
+    static const uint32_t cache_magic = 0x4352564d; // "MVRC"
+    std::string file_path;
+    std::set<std::string> listed_dirs;
+    std::map<std::string, RemoteEntry> entries;
+};
+
+#endif
@@ -0,0 +1,249 @@
+#ifndef _SEND_PIPELINE_H_
+#define _SEND_PIPELINE_H_
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include "common.h"
+#include "buffer_pool.h"
+#include "timeline.h"
+
+// lock-free ring between exactly one producer and one consumer thread
+template<typename T, size_t N>
+class SpscQueue {
+public:
+    bool Push(const T& val) {
+        size_t tail = tail_pos.load(std::memory_order_relaxed);
+        if(tail - head_pos.load(std::memory_order_acquire) == N)
+            return false;
+        ring[tail % N] = val;
+        tail_pos.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T& val) {
+        size_t head = head_pos.load(std::memory_order_relaxed);
+        if(head == tail_pos.load(std::memory_order_acquire))
+            return false;
+        val = ring[head % N];
+        head_pos.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+protected:
+    T ring[N];
+    // keep the two ends on separate cache lines
+    std::atomic<size_t> head_pos{0};
+    char head_pad[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail_pos{0};
+};
+
+// reader -> framer -> writer threads for an upload, the coroutine path does all three in turn on one thread.
+// the reader fills pool chunks from the source, the framer cuts them into content packets and marks
+// window ends, the writer sends each chunk in one gathered write and waits for a credit at each pause.
+// acks only hand out credits, the writer calls the window hooks so the tuner stays on one thread
+template<typename CONTENT, typename PAUSE, typename END>
+class SendPipeline {
+public:
+    typedef std::function<size_t(uint8_t*, size_t)> ReadFun;
+
+    static const size_t max_chunks = 16;
+
+    ~SendPipeline() {
+        Stop();
+        for(size_t i = 0; i < chunk_count; ++i)
+            BufferPool::Shared().Release(chunks[i].data, upload_chunk_size);
+    }
+
+    // pause_at_end sends a pause after the last partial window too (install), END follows without waiting.
+    // window is the fallback when the sender does not size windows itself, no window grows past max_window
+    void Start(Sender& s, ReadFun read, size_t window, bool pause_at_end, size_t max_window = (size_t)-1) {
+        sender = &s;
+        read_fun = read;
+        window_size = window;
+        window_limit = max_window;
+        end_pause = pause_at_end;
+        // a quarter of the memory cap at most, the rest belongs to the other buffers
+        chunk_count = max_chunks;
+        size_t limit = BufferPool::Shared().Limit();
+        if(limit && limit / 4 / upload_chunk_size < chunk_count)
+            chunk_count = limit / 4 / upload_chunk_size < 2 ? 2 : limit / 4 / upload_chunk_size;
+        for(size_t i = 0; i < chunk_count; ++i) {
+            chunks[i].data = (uint8_t*)BufferPool::Shared().Acquire(upload_chunk_size);
+            free_chunks.Push(&chunks[i]);
+        }
+        reader = std::thread([this]() {
+            Timeline::Shared().NameThread("pipeline reader");
+            ReadLoop();
+        });
+        framer = std::thread([this]() {
+            Timeline::Shared().NameThread("pipeline framer");
+            FrameLoop();
+        });
+        writer = std::thread([this, &s]() {
+            Timeline::Shared().NameThread("pipeline writer");
+            WriteLoop(s);
+        });
+    }
+
+    void Credit() {
+        credits.fetch_add(1, std::memory_order_release);
+    }
+
+    // END went out, the upload is complete on the wire
+    bool Ended() {
+        return ended;
+    }
+
+    void Stop() {
+        stopped = true;
+        if(reader.joinable())
+            reader.join();
+        if(framer.joinable())
+            framer.join();
+        if(writer.joinable())
+            writer.join();
+    }
+
+protected:
+    struct Chunk {
+        uint8_t* data = nullptr;
+        size_t size = 0;
+        bool last = false;
+        bool pause = false;
+        pkt_base heads[upload_chunk_size / 1024];
+        iovec iov[upload_chunk_size / 1024 * 2];
+        int32_t iov_count = 0;
+    };
+
+    // spin briefly, then back off so a stage waiting on the device does not burn a core
+    template<typename COND>
+    bool WaitFor(COND cond) {
+        for(uint32_t spin = 0; !cond(); ++spin) {
+            if(stopped)
+                return false;
+            if(spin < 64)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        return true;
+    }
+
+    void ReadLoop() {
+        while(true) {
+            Chunk* chunk = nullptr;
+            if(!WaitFor([&]() { return free_chunks.Pop(chunk); }))
+                return;
+            chunk->size = 0;
+            while(chunk->size < upload_chunk_size) {
+                size_t len = read_fun(chunk->data + chunk->size, upload_chunk_size - chunk->size);
+                if(len == 0)
+                    break;
+                chunk->size += len;
+            }
+            chunk->last = chunk->size < upload_chunk_size;
+            if(!WaitFor([&]() { return filled_chunks.Push(chunk); }) || chunk->last)
+                return;
+        }
+    }
+
+    size_t NextWindow() {
+        size_t window = std::min(sender->WindowSize(window_size), window_limit) / upload_chunk_size * upload_chunk_size;
+        return window ? window : upload_chunk_size;
+    }
+
+    void FrameLoop() {
+        size_t window_bytes = 0;
+        size_t window = NextWindow();
+        while(true) {
+            Chunk* chunk = nullptr;
+            if(!WaitFor([&]() { return filled_chunks.Pop(chunk); }))
+                return;
+            chunk->iov_count = 0;
+            for(size_t pos = 0, idx = 0; pos < chunk->size; pos += 1024, ++idx) {
+                size_t len = chunk->size - pos < 1024 ? chunk->size - pos : 1024;
+                chunk->heads[idx] = CONTENT::Header(len);
+                chunk->iov[chunk->iov_count++] = {&chunk->heads[idx], 4};
+                chunk->iov[chunk->iov_count++] = {chunk->data + pos, len};
+            }
+            window_bytes += chunk->size;
+            chunk->pause = window_bytes >= window || (chunk->last && end_pause && window_bytes);
+            if(chunk->pause) {
+                window_bytes = 0;
+                // runs ahead of the acks by the queued chunks, the size may lag a window behind
+                window = NextWindow();
+            }
+            if(!WaitFor([&]() { return framed_chunks.Push(chunk); }) || chunk->last)
+                return;
+        }
+    }
+
+    void WriteLoop(Sender& s) {
+        size_t window_bytes = 0;
+        s.BeginWindow();
+        while(true) {
+            Chunk* chunk = nullptr;
+            // stopped mid window, uncork so what follows (the end of a cancel) goes out at once
+            if(!WaitFor([&]() { return framed_chunks.Pop(chunk); })) {
+                s.EndWindow(window_bytes);
+                return;
+            }
+            if(chunk->iov_count)
+                s.SendV(chunk->iov, chunk->iov_count);
+            window_bytes += chunk->size;
+            bool last = chunk->last;
+            bool pause = chunk->pause;
+            free_chunks.Push(chunk);
+            if(pause) {
+                PAUSE::Send(s);
+                s.EndWindow(window_bytes);
+                window_bytes = 0;
+                if(!(last && end_pause)) {
+                    TimelineSpan span("credit wait", "net");
+                    if(!WaitFor([this]() { return TakeCredit(); }))
+                        return;
+                    s.WindowAcked();
+                    if(!last)
+                        s.BeginWindow();
+                }
+            }
+            if(last) {
+                END::Send(s);
+                ended = true;
+                if(!pause)
+                    s.EndWindow(window_bytes);
+                return;
+            }
+        }
+    }
+
+    bool TakeCredit() {
+        int32_t val = credits.load(std::memory_order_acquire);
+        while(val > 0) {
+            if(credits.compare_exchange_weak(val, val - 1))
+                return true;
+        }
+        return false;
+    }
+
+    Chunk chunks[max_chunks];
+    size_t chunk_count = 0;
+    SpscQueue<Chunk*, max_chunks> free_chunks;
+    SpscQueue<Chunk*, max_chunks> filled_chunks;
+    SpscQueue<Chunk*, max_chunks> framed_chunks;
+    Sender* sender = nullptr;
+    ReadFun read_fun;
+    size_t window_size = 0;
+    size_t window_limit = (size_t)-1;
+    bool end_pause = false;
+    std::atomic<int32_t> credits{0};
+    std::atomic<bool> stopped{false};
+    std::atomic<bool> ended{false};
+    std::thread reader;
+    std::thread framer;
+    std::thread writer;
+};
+
+#endif
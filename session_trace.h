@@ -0,0 +1,155 @@
+#ifndef _SESSION_TRACE_H_
+#define _SESSION_TRACE_H_
+
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+
+#include "common.h"
+
+// compact binary trace of one session, every packet either side sent with its timestamp.
+// file: u32 magic, u32 version, then records of
+//   u32 delta_us, u8 dir, u8 flags, short type, short length, [length - 4 bytes payload if kept]
+// bulk content (copy/install upload, down content) keeps only its length, replay sends zeros
+class SessionTrace {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    enum {
+        dir_client = 0,
+        dir_device = 1,
+    };
+
+    enum {
+        flag_payload = 0x1,
+    };
+
+    struct Record {
+        uint64_t time_us = 0;
+        uint8_t dir = 0;
+        uint8_t flags = 0;
+        short type = 0;
+        short length = 0;
+        std::vector<uint8_t> payload;
+    };
+
+    ~SessionTrace() {
+        if(trace_file)
+            fclose(trace_file);
+    }
+
+    bool Create(const std::string& path) {
+        trace_file = fopen(path.c_str(), "wb");
+        if(!trace_file)
+            return false;
+        uint32_t head[2] = {trace_magic, trace_version};
+        fwrite(head, 4, 2, trace_file);
+        last_time = clock::now();
+        return true;
+    }
+
+    // raw bytes as handed to the socket, packets are framed here because Send gets them in pieces
+    void Sent(const void* data, size_t length) {
+        const uint8_t* ptr = (const uint8_t*)data;
+        while(length) {
+            if(skip_left) {
+                size_t len = length < skip_left ? length : skip_left;
+                skip_left -= len;
+                ptr += len;
+                length -= len;
+                continue;
+            }
+            out_pending.push_back(*ptr++);
+            length--;
+            if(out_pending.size() < 4)
+                continue;
+            pkt_base hdr = read_header(out_pending.data());
+            if(hdr.length < 4) {
+                out_pending.clear();
+                continue;
+            }
+            if(IsBulk(dir_client, hdr.type, hdr.length)) {
+                Write(dir_client, hdr.type, hdr.length, nullptr);
+                skip_left = hdr.length - 4;
+                out_pending.clear();
+            } else if(out_pending.size() == (size_t)hdr.length) {
+                Write(dir_client, hdr.type, hdr.length, &out_pending[4]);
+                out_pending.clear();
+            }
+        }
+    }
+
+    void Received(short type, const void* data, int32_t length) {
+        Write(dir_device, type, length + 4, IsBulk(dir_device, type, length + 4) ? nullptr : data);
+    }
+
+    static bool Load(const std::string& path, std::vector<Record>& records) {
+        FILE* f = fopen(path.c_str(), "rb");
+        if(!f)
+            return false;
+        uint32_t head[2] = {0};
+        if(fread(head, 4, 2, f) != 2 || head[0] != trace_magic || head[1] != trace_version) {
+            fclose(f);
+            return false;
+        }
+        uint64_t now_us = 0;
+        uint8_t raw[10];
+        while(fread(raw, 1, 10, f) == 10) {
+            Record rec;
+            uint32_t delta = 0;
+            memcpy(&delta, raw, 4);
+            now_us += delta;
+            rec.time_us = now_us;
+            rec.dir = raw[4];
+            rec.flags = raw[5];
+            memcpy(&rec.type, &raw[6], 2);
+            memcpy(&rec.length, &raw[8], 2);
+            if((rec.flags & flag_payload) && rec.length > 4) {
+                rec.payload.resize(rec.length - 4);
+                if(fread(rec.payload.data(), 1, rec.payload.size(), f) != rec.payload.size())
+                    break;
+            }
+            records.push_back(std::move(rec));
+        }
+        fclose(f);
+        return true;
+    }
+
+protected:
+    static bool IsBulk(uint8_t dir, short type, short length) {
+        if(length <= 4)
+            return false;
+        if(dir == dir_client)
+            return type == 0x11 || type == 0x21;
+        return type == 0x14;
+    }
+
+    void Write(uint8_t dir, short type, short length, const void* payload) {
+        if(!trace_file)
+            return;
+        // the pipeline writer sends while the main loop receives
+        std::unique_lock<std::mutex> lock(write_mutex);
+        auto now = clock::now();
+        uint32_t delta = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - last_time).count();
+        last_time = now;
+        uint8_t raw[10];
+        memcpy(raw, &delta, 4);
+        raw[4] = dir;
+        raw[5] = payload ? flag_payload : 0;
+        memcpy(&raw[6], &type, 2);
+        memcpy(&raw[8], &length, 2);
+        fwrite(raw, 1, 10, trace_file);
+        if(payload && length > 4)
+            fwrite(payload, 1, length - 4, trace_file);
+    }
+
+    static const uint32_t trace_magic = 0x52544d56;
+    static const uint32_t trace_version = 1;
+    FILE* trace_file = nullptr;
+    std::mutex write_mutex;
+    clock::time_point last_time;
+    std::vector<uint8_t> out_pending;
+    size_t skip_left = 0;
+};
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef _STREAM_CACHE_H_
+#define _STREAM_CACHE_H_
+
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "zip_entry_table.h"
+
+// the framed record stream of a full install, built while a vpk is sent and served from
+// ~/.vitamgr on later installs. content packets are full 1024 byte packets except the last one,
+// so every packet boundary can take a pause and windows keep adapting instead of being baked in.
+// file: u32 magic, u32 version, key (path, size, mtime, inode), i32 deflate level, i64 total size,
+//       u32 install flag, u64 payload size, then the VTP_VPK_CONTENT packets
+class StreamCache {
+public:
+    ~StreamCache() {
+        Discard();
+        if(fd >= 0)
+            close(fd);
+    }
+
+    // a finished stream for this vpk built with the same deflate level
+    bool Open(const ZipIndexKey& key, int32_t level) {
+        std::ifstream f(FilePath(key), std::ios::in | std::ios::binary);
+        if(!f)
+            return false;
+        uint32_t magic = 0, version = 0;
+        ZipIndexKey file_key;
+        int32_t file_level = 0;
+        f.read((char*)&magic, 4);
+        f.read((char*)&version, 4);
+        if(magic != cache_magic || version != cache_version)
+            return false;
+        file_key.path = read_string(f);
+        f.read((char*)&file_key.size, 8);
+        f.read((char*)&file_key.mtime, 8);
+        f.read((char*)&file_key.inode, 8);
+        f.read((char*)&file_level, 4);
+        f.read((char*)&total_size, 8);
+        f.read((char*)&flag, 4);
+        f.read((char*)&payload_size, 8);
+        if(!f || file_key.path != key.path || file_key.size != key.size || file_key.mtime != key.mtime
+            || file_key.inode != key.inode || file_level != level)
+            return false;
+        data_offset = f.tellg();
+        fd = open(FilePath(key).c_str(), O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) != 0 || (uint64_t)st.st_size != FileOffset(payload_size)) {
+            if(fd >= 0)
+                close(fd);
+            fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    // starts writing a stream, it only replaces the cached one on Commit
+    bool Create(const ZipIndexKey& key, int32_t level, int64_t total, uint32_t install_flag) {
+        file_path = FilePath(key);
+        tmp_path = file_path + ".tmp";
+        out_file = fopen(tmp_path.c_str(), "wb");
+        if(!out_file)
+            return false;
+        uint32_t head[2] = {cache_magic, cache_version};
+        uint16_t len = key.path.length();
+        fwrite(head, 4, 2, out_file);
+        fwrite(&len, 2, 1, out_file);
+        fwrite(key.path.c_str(), 1, len, out_file);
+        fwrite(&key.size, 8, 1, out_file);
+        fwrite(&key.mtime, 8, 1, out_file);
+        fwrite(&key.inode, 8, 1, out_file);
+        fwrite(&level, 4, 1, out_file);
+        fwrite(&total, 8, 1, out_file);
+        fwrite(&install_flag, 4, 1, out_file);
+        size_field = ftell(out_file);
+        payload_size = 0;
+        fwrite(&payload_size, 8, 1, out_file);
+        pending.clear();
+        return true;
+    }
+
+    bool Writing() {
+        return out_file != nullptr;
+    }
+
+    // record stream bytes in send order, framed here
+    void Append(const uint8_t* data, size_t len) {
+        if(!out_file)
+            return;
+        payload_size += len;
+        while(len) {
+            size_t chunk = std::min(len, 1024 - pending.size());
+            pending.insert(pending.end(), data, data + chunk);
+            data += chunk;
+            len -= chunk;
+            if(pending.size() == 1024)
+                FlushPacket();
+        }
+    }
+
+    // the install went through, the stream becomes the cached one
+    bool Commit() {
+        if(!out_file)
+            return false;
+        if(!pending.empty())
+            FlushPacket();
+        fseek(out_file, size_field, SEEK_SET);
+        fwrite(&payload_size, 8, 1, out_file);
+        bool ok = fclose(out_file) == 0;
+        out_file = nullptr;
+        if(ok && rename(tmp_path.c_str(), file_path.c_str()) == 0)
+            return true;
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    void Discard() {
+        if(!out_file)
+            return;
+        fclose(out_file);
+        out_file = nullptr;
+        unlink(tmp_path.c_str());
+    }
+
+    // file offset of a payload position on a packet boundary (a multiple of 1024 or the end)
+    uint64_t FileOffset(uint64_t payload_pos) {
+        uint64_t packets = payload_pos / 1024;
+        uint64_t rest = payload_pos % 1024;
+        return data_offset + packets * 1028 + (rest ? rest + 4 : 0);
+    }
+
+    int32_t Fd() {
+        return fd;
+    }
+
+    uint64_t PayloadSize() {
+        return payload_size;
+    }
+
+    int64_t TotalSize() {
+        return total_size;
+    }
+
+    uint32_t Flag() {
+        return flag;
+    }
+
+protected:
+    static std::string FilePath(const ZipIndexKey& key) {
+        char name[32];
+        snprintf(name, sizeof(name), "stream_%016llx.vst", (unsigned long long)std::hash<std::string>()(key.path));
+        return cache_path(name);
+    }
+
+    void FlushPacket() {
+        pkt_base hdr = VTP_VPK_CONTENT::Header(pending.size());
+        fwrite(&hdr, 4, 1, out_file);
+        fwrite(pending.data(), 1, pending.size(), out_file);
+        pending.clear();
+    }
+
+    static const uint32_t cache_magic = 0x5453564d; // "MVST"
+    static const uint32_t cache_version = 2;
+    int32_t fd = -1;
+    uint64_t data_offset = 0;
+    uint64_t payload_size = 0;
+    int64_t total_size = 0;
+    uint32_t flag = 0;
+    FILE* out_file = nullptr;
+    long size_field = 0;
+    std::string file_path;
+    std::string tmp_path;
+    std::vector<uint8_t> pending;
+};
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef _SYNC_HANDLER_H_
+#define _SYNC_HANDLER_H_
+
+#include <dirent.h>
+#include <chrono>
+#include <map>
+#include <set>
+
+#include "common.h"
+#include "copy_handler.h"
+#include "list_handler.h"
+#include "sync_manifest.h"
+
+// makes a remote directory match a local tree over one connection:
+// list the remote side, remove extras (with --delete), copy what is new or changed, list again
+// and record both sides in the sync manifest. a file counts as unchanged only while its local
+// size/mtime (nanoseconds) and its remote size/mtime all match the last sync, so the first sync copies everything.
+// the next file is opened and read ahead while the current one uploads.
+// the protocol has no packet to make a directory, the device creates them for the files copied into them,
+// so an empty local directory does not appear remotely (and is kept there with --delete)
+class SyncHandler : public PacketHandler {
+public:
+    ~SyncHandler() {
+        if(list)
+            delete list;
+        if(copy)
+            delete copy;
+        if(next_copy)
+            delete next_copy;
+    }
+
+    bool Load(const std::string& dev, const std::string& local, const std::string& remote) {
+        struct stat st;
+        if(stat(local.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+            return false;
+        device = dev;
+        local_dir = local;
+        remote_dir = RemoteCache::NormalizePath(remote);
+        if(!VTP_LIST_DIR::Fits(remote_dir.length() + 1)) {
+            std::cout << "remote path " << remote_dir << " is too long." << std::endl;
+            return false;
+        }
+        WalkLocal(local_dir, "");
+        manifest.Load(device, remote_dir);
+        return true;
+    }
+
+    void SetOptions(bool remove_extras, bool pipeline) {
+        delete_extras = remove_extras;
+        pipeline_mode = pipeline;
+    }
+
+    int32_t InitSend(Sender& s) {
+        sync_begin = std::chrono::steady_clock::now();
+        return StartListing(s);
+    }
+
+    int32_t HandlePacket(Sender& s, short type, void* data, int32_t length) {
+        switch(phase) {
+            case phase_list: {
+                if(!list->HandlePacket(s, type, data, length))
+                    return 0;
+                // a remote directory that does not exist yet is an empty one
+                if(list->Result() != 0 && list->Result() != 4) {
+                    std::cout << "cannot list " << remote_dir << "." << std::endl;
+                    return 1;
+                }
+                MakePlan();
+                if(copies.empty() && removes.empty()) {
+                    std::cout << "sync: " << unchanged << " files up to date." << std::endl;
+                    SaveManifest();
+                    return 1;
+                }
+                // the cached listing is stale from here on, the final listing replaces it
+                list->Cache().Invalidate(remote_dir);
+                list->Cache().Save();
+                delete list;
+                list = nullptr;
+                phase = phase_remove;
+                return Next(s);
+            }
+            case phase_remove: {
+                if(type != 0x40)
+                    return 0;
+                int32_t result = VTRP_REMOVE_PATH::View(data, length).Get<0>();
+                std::cout << (result == 0 ? "done." : "failed.") << std::endl;
+                if(result == 0)
+                    removed++;
+                remove_pos++;
+                return Next(s);
+            }
+            case phase_copy: {
+                if(!copy->HandlePacket(s, type, data, length))
+                    return 0;
+                if(copy->Succeeded())
+                    copied++;
+                else
+                    failed_files.insert(copies[copy_pos]);
+                delete copy;
+                copy = nullptr;
+                copy_pos++;
+                return Next(s);
+            }
+            case phase_relist: {
+                if(!list->HandlePacket(s, type, data, length))
+                    return 0;
+                if(list->Result() == 0)
+                    SaveManifest();
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - sync_begin).count();
+                std::cout << "sync: " << copied << " copied, " << failed_files.size() << " failed, " << removed << " removed, "
+                    << unchanged << " unchanged in " << elapsed << " s." << std::endl;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+protected:
+    enum {
+        phase_list,
+        phase_remove,
+        phase_copy,
+        phase_relist,
+    };
+
+    struct LocalFile {
+        uint64_t size = 0;
+        int64_t mtime = 0;
+    };
+
+    void WalkLocal(const std::string& dir, const std::string& rel) {
+        DIR* d = opendir(dir.c_str());
+        if(!d)
+            return;
+        while(dirent* ent = readdir(d)) {
+            if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+                continue;
+            std::string full = dir + "/" + ent->d_name;
+            std::string name = rel.empty() ? std::string(ent->d_name) : rel + "/" + ent->d_name;
+            struct stat st;
+            if(stat(full.c_str(), &st) != 0)
+                continue;
+            if(S_ISDIR(st.st_mode)) {
+                local_dirs.insert(name);
+                WalkLocal(full, name);
+            } else if(S_ISREG(st.st_mode)) {
+                LocalFile& lf = local_files[name];
+                lf.size = st.st_size;
+                lf.mtime = stat_mtime_ns(st);
+            }
+        }
+        closedir(d);
+    }
+
+    int32_t StartListing(Sender& s) {
+        list = new ListHandler();
+        list->Load(device, remote_dir);
+        list->SetQuiet(true);
+        return list->InitSend(s);
+    }
+
+    void MakePlan() {
+        std::string prefix = RemoteCache::JoinPath(remote_dir, "");
+        if(list->Result() == 0) {
+            list->Cache().ForEach(remote_dir, [this, &prefix](const std::string& path, const RemoteEntry& ent) {
+                remote_files[path.substr(prefix.length())] = ent;
+            });
+        }
+        uint64_t copy_bytes = 0;
+        for(auto& iter : local_files) {
+            auto remote = remote_files.find(iter.first);
+            if(remote == remote_files.end() || (remote->second.attr & 0x1)
+                || manifest.IsChanged(iter.first, iter.second.size, iter.second.mtime, remote->second.size, remote->second.mtime)) {
+                copies.push_back(iter.first);
+                copy_bytes += iter.second.size;
+            } else
+                unchanged++;
+        }
+        if(delete_extras) {
+            // a removed directory takes everything below it, its children are skipped
+            std::set<std::string> removed_dirs;
+            for(auto& iter : remote_files) {
+                bool is_dir = (iter.second.attr & 0x1) != 0;
+                bool below = false;
+                for(size_t pos = iter.first.rfind('/'); pos != std::string::npos && pos > 0 && !below; pos = iter.first.rfind('/', pos - 1))
+                    below = removed_dirs.count(iter.first.substr(0, pos)) != 0;
+                if(below || (is_dir ? local_dirs.count(iter.first) != 0 : local_files.count(iter.first) != 0))
+                    continue;
+                removes.push_back(iter.first);
+                if(is_dir)
+                    removed_dirs.insert(iter.first);
+            }
+        }
+        std::cout << "sync: " << copies.size() << " to copy (" << copy_bytes << " bytes), " << removes.size()
+            << " to remove, " << unchanged << " unchanged." << std::endl;
+    }
+
+    CopyHandler* OpenCopy(size_t pos) {
+        auto ch = new CopyHandler();
+        if(!ch->Load(local_dir + "/" + copies[pos], RemoteCache::JoinPath(remote_dir, copies[pos]))) {
+            delete ch;
+            return nullptr;
+        }
+        ch->EnablePipeline(pipeline_mode);
+        return ch;
+    }
+
+    // removes go first, they may clear a directory where a file is about to be copied
+    int32_t Next(Sender& s) {
+        while(remove_pos < removes.size()) {
+            std::cout << "Removing " << removes[remove_pos] << " ... " << std::flush;
+            if(VTP_REMOVE_PATH::SendTail(s, RemoteCache::JoinPath(remote_dir, removes[remove_pos])))
+                return 0;
+            remove_pos++;
+        }
+        phase = phase_copy;
+        while(copy_pos < copies.size()) {
+            copy = next_copy ? next_copy : OpenCopy(copy_pos);
+            next_copy = nullptr;
+            if(copy)
+                break;
+            std::cout << "local file " << copies[copy_pos] << " load fail, skipped." << std::endl;
+            failed_files.insert(copies[copy_pos]);
+            copy_pos++;
+        }
+        if(copy) {
+            std::cout << "[" << copy_pos + 1 << "/" << copies.size() << "]: Copying " << copies[copy_pos]
+                << " (" << local_files[copies[copy_pos]].size << " bytes) ... " << std::flush;
+            if(copy_pos + 1 < copies.size() && (next_copy = OpenCopy(copy_pos + 1)))
+                next_copy->Prefetch();
+            if(copy->InitSend(s) == 0)
+                return 0;
+            failed_files.insert(copies[copy_pos]);
+            delete copy;
+            copy = nullptr;
+            copy_pos++;
+            return Next(s);
+        }
+        phase = phase_relist;
+        return StartListing(s);
+    }
+
+    // files whose remote side matches after the sync are recorded, anything else is copied next time
+    void SaveManifest() {
+        manifest.entries.clear();
+        std::string prefix = RemoteCache::JoinPath(remote_dir, "");
+        list->Cache().ForEach(remote_dir, [this, &prefix](const std::string& path, const RemoteEntry& ent) {
+            std::string name = path.substr(prefix.length());
+            auto local = local_files.find(name);
+            if(local == local_files.end() || (ent.attr & 0x1) || ent.size != local->second.size || failed_files.count(name))
+                return;
+            SyncEntry& se = manifest.entries[name];
+            se.local_size = local->second.size;
+            se.local_mtime = local->second.mtime;
+            se.remote_size = ent.size;
+            se.remote_mtime = ent.mtime;
+        });
+        manifest.Save();
+    }
+
+    std::string device;
+    std::string local_dir;
+    std::string remote_dir;
+    bool delete_extras = false;
+    bool pipeline_mode = false;
+    int32_t phase = phase_list;
+    std::map<std::string, LocalFile> local_files;
+    std::set<std::string> local_dirs;
+    std::map<std::string, RemoteEntry> remote_files;
+    SyncManifest manifest;
+    std::vector<std::string> copies;
+    std::vector<std::string> removes;
+    std::set<std::string> failed_files;
+    size_t copy_pos = 0;
+    size_t remove_pos = 0;
+    size_t copied = 0;
+    size_t removed = 0;
+    size_t unchanged = 0;
+    ListHandler* list = nullptr;
+    CopyHandler* copy = nullptr;
+    CopyHandler* next_copy = nullptr;
+    std::chrono::steady_clock::time_point sync_begin;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef _SYNC_MANIFEST_H_
+#define _SYNC_MANIFEST_H_
+
+#include <map>
+
+#include "common.h"
+
+struct SyncEntry {
+    uint64_t local_size = 0;
+    int64_t local_mtime = 0;    // nanoseconds
+    uint64_t remote_size = 0;
+    uint32_t remote_mtime = 0;
+};
+
+// what the last sync of a remote directory left there, per file relative to it.
+// a file is unchanged while both its local and its remote side still match
+class SyncManifest {
+public:
+    bool Load(const std::string& device, const std::string& remote_dir) {
+        char name[64];
+        snprintf(name, sizeof(name), "_%016llx.sync", (unsigned long long)std::hash<std::string>()(remote_dir));
+        file_path = cache_path("sync_" + device + name);
+        entries.clear();
+        std::ifstream f(file_path, std::ios::in | std::ios::binary);
+        if(!f)
+            return false;
+        uint32_t magic = 0, count = 0;
+        f.read((char*)&magic, 4);
+        if(magic != manifest_magic)
+            return false;
+        f.read((char*)&count, 4);
+        for(uint32_t i = 0; i < count && f; ++i) {
+            std::string name = read_string(f);
+            SyncEntry& ent = entries[name];
+            f.read((char*)&ent.local_size, 8);
+            f.read((char*)&ent.local_mtime, 8);
+            f.read((char*)&ent.remote_size, 8);
+            f.read((char*)&ent.remote_mtime, 4);
+        }
+        if(!f) {
+            entries.clear();
+            return false;
+        }
+        return true;
+    }
+
+    bool Save() {
+        std::string tmp_path = file_path + ".tmp";
+        std::ofstream f(tmp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if(!f)
+            return false;
+        uint32_t magic = manifest_magic;
+        uint32_t count = entries.size();
+        f.write((const char*)&magic, 4);
+        f.write((const char*)&count, 4);
+        for(auto& iter : entries) {
+            write_string(f, iter.first);
+            f.write((const char*)&iter.second.local_size, 8);
+            f.write((const char*)&iter.second.local_mtime, 8);
+            f.write((const char*)&iter.second.remote_size, 8);
+            f.write((const char*)&iter.second.remote_mtime, 4);
+        }
+        f.close();
+        if(!f)
+            return false;
+        return rename(tmp_path.c_str(), file_path.c_str()) == 0;
+    }
+
+    bool IsChanged(const std::string& name, uint64_t local_size, int64_t local_mtime, uint64_t remote_size, uint32_t remote_mtime) {
+        auto iter = entries.find(name);
+        return iter == entries.end() || iter->second.local_size != local_size || iter->second.local_mtime != local_mtime
+            || iter->second.remote_size != remote_size || iter->second.remote_mtime != remote_mtime;
+    }
+
+    std::map<std::string, SyncEntry> entries;
+
+protected:
+    static const uint32_t manifest_magic = 0x4d53564d; // "MVSM"
+    std::string file_path;
+};
+
+#endif
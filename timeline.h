@@ -0,0 +1,192 @@
+#ifndef _TIMELINE_H_
+#define _TIMELINE_H_
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+
+#include "common.h"
+
+// opt-in timeline of a session in chrome trace-event json (open it in Perfetto or chrome://tracing).
+// spans for resume, send, read, instants for yields and acks, async spans for install entries.
+// when off every hook is a single test of a static flag
+class Timeline {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    static Timeline& Shared() {
+        static Timeline timeline;
+        return timeline;
+    }
+
+    static bool On() {
+        return Flag();
+    }
+
+    void Enable() {
+        begin = clock::now();
+        Flag() = true;
+    }
+
+    static int64_t Now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - Shared().begin).count();
+    }
+
+    // a finished span, bytes < 0 leaves out the size
+    void Complete(const char* name, const char* cat, int64_t ts, int64_t dur, int64_t bytes = -1) {
+        Event ev;
+        ev.name = name;
+        ev.cat = cat;
+        ev.phase = 'X';
+        ev.ts = ts;
+        ev.dur = dur;
+        ev.bytes = bytes;
+        Add(ev);
+    }
+
+    void Instant(const char* name, const char* cat) {
+        if(!On())
+            return;
+        Event ev;
+        ev.name = name;
+        ev.cat = cat;
+        ev.phase = 'i';
+        ev.ts = Now();
+        Add(ev);
+    }
+
+    // spans that outlive a stack frame (an entry sent across several windows) get their own track
+    void AsyncBegin(const char* name, const char* cat, uint64_t id, const std::string& detail) {
+        if(!On())
+            return;
+        Event ev;
+        ev.name = name;
+        ev.cat = cat;
+        ev.phase = 'b';
+        ev.ts = Now();
+        ev.id = id;
+        ev.detail = detail;
+        Add(ev);
+    }
+
+    void AsyncEnd(const char* name, const char* cat, uint64_t id) {
+        if(!On())
+            return;
+        Event ev;
+        ev.name = name;
+        ev.cat = cat;
+        ev.phase = 'e';
+        ev.ts = Now();
+        ev.id = id;
+        Add(ev);
+    }
+
+    void NameThread(const std::string& name) {
+        if(!On())
+            return;
+        Event ev;
+        ev.name = "thread_name";
+        ev.cat = "";
+        ev.phase = 'M';
+        ev.detail = name;
+        Add(ev);
+    }
+
+    bool Write(const std::string& path) {
+        FILE* f = fopen(path.c_str(), "w");
+        if(!f)
+            return false;
+        std::unique_lock<std::mutex> lock(event_mutex);
+        fprintf(f, "{\"traceEvents\":[\n");
+        for(size_t i = 0; i < events.size(); ++i) {
+            auto& ev = events[i];
+            fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%lld",
+                ev.name, ev.cat, ev.phase, ev.tid, (long long)ev.ts);
+            if(ev.phase == 'X')
+                fprintf(f, ",\"dur\":%lld", (long long)ev.dur);
+            if(ev.phase == 'i')
+                fprintf(f, ",\"s\":\"t\"");
+            if(ev.phase == 'b' || ev.phase == 'e')
+                fprintf(f, ",\"id\":%llu", (unsigned long long)ev.id);
+            if(ev.phase == 'M')
+                fprintf(f, ",\"args\":{\"name\":\"%s\"}", Escape(ev.detail).c_str());
+            else if(!ev.detail.empty())
+                fprintf(f, ",\"args\":{\"detail\":\"%s\"}", Escape(ev.detail).c_str());
+            else if(ev.bytes >= 0)
+                fprintf(f, ",\"args\":{\"bytes\":%lld}", (long long)ev.bytes);
+            fprintf(f, "}%s\n", i + 1 < events.size() ? "," : "");
+        }
+        fprintf(f, "]}\n");
+        fclose(f);
+        return true;
+    }
+
+protected:
+    struct Event {
+        const char* name = "";
+        const char* cat = "";
+        char phase = 'X';
+        int32_t tid = 0;
+        int64_t ts = 0;
+        int64_t dur = 0;
+        int64_t bytes = -1;
+        uint64_t id = 0;
+        std::string detail;
+    };
+
+    static bool& Flag() {
+        static bool enabled = false;
+        return enabled;
+    }
+
+    static int32_t ThreadId() {
+        static std::atomic<int32_t> next_tid(1);
+        thread_local int32_t tid = next_tid++;
+        return tid;
+    }
+
+    static std::string Escape(const std::string& str) {
+        std::string res;
+        for(char c : str) {
+            if(c == '"' || c == '\\')
+                res.push_back('\\');
+            if((uint8_t)c >= 0x20)
+                res.push_back(c);
+        }
+        return res;
+    }
+
+    void Add(Event& ev) {
+        ev.tid = ThreadId();
+        std::unique_lock<std::mutex> lock(event_mutex);
+        events.push_back(std::move(ev));
+    }
+
+    clock::time_point begin = clock::now();
+    std::mutex event_mutex;
+    std::vector<Event> events;
+};
+
+// scoped span, records nothing unless the timeline is on
+class TimelineSpan {
+public:
+    TimelineSpan(const char* span_name, const char* span_cat, int64_t span_bytes = -1)
+        : name(span_name), cat(span_cat), bytes(span_bytes) {
+        if(Timeline::On())
+            begin = Timeline::Now();
+    }
+
+    ~TimelineSpan() {
+        if(begin >= 0)
+            Timeline::Shared().Complete(name, cat, begin, Timeline::Now() - begin, bytes);
+    }
+
+protected:
+    const char* name;
+    const char* cat;
+    int64_t bytes;
+    int64_t begin = -1;
+};
+
+#endif
@@ -1,16 +1,97 @@
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 #include "common.h"
 #include "copy_handler.h"
+#include "down_handler.h"
 #include "install_handler.h"
+#include "batch_install_handler.h"
+#include "list_handler.h"
+#include "sync_handler.h"
+#include "net_tuning.h"
+#include "buffer_pool.h"
+#include "session_trace.h"
+#include "rate_limiter.h"
+#include "timeline.h"
 
 class LocalSender : public Sender {
 public:
     LocalSender(int32_t client) {
         remote = client;
+        tuner.Attach(client);
     }
     
+    static int64_t IovBytes(const iovec* iov, int32_t count) {
+        int64_t bytes = 0;
+        for(int32_t i = 0; i < count; ++i)
+            bytes += iov[i].iov_len;
+        return bytes;
+    }
+
     size_t Send(void* data, size_t length) {
+        TimelineSpan span("send", "net", length);
+        if(trace)
+            trace->Sent(data, length);
+        RateLimiter::Shared().Consume(length);
         return send(remote, data, length, 0);
     }
+
+    // under --rate a batch goes out in slices of a few packets, each paid for before it is sent
+    size_t SendV(const iovec* iov, int32_t count, bool zerocopy) {
+        TimelineSpan span("sendv", "net", Timeline::On() ? IovBytes(iov, count) : -1);
+        if(trace) {
+            for(int32_t i = 0; i < count; ++i)
+                trace->Sent(iov[i].iov_base, iov[i].iov_len);
+        }
+        if(!RateLimiter::Shared().Enabled())
+            return tuner.SendV(iov, count, zerocopy);
+        size_t sent = 0;
+        size_t slice = 0;
+        int32_t begin = 0;
+        for(int32_t i = 0; i < count; ++i) {
+            slice += iov[i].iov_len;
+            if(slice >= RateLimiter::slice_size || i + 1 == count) {
+                RateLimiter::Shared().Consume(slice);
+                sent += tuner.SendV(&iov[begin], i + 1 - begin, zerocopy);
+                begin = i + 1;
+                slice = 0;
+            }
+        }
+        return sent;
+    }
+
+    // cached install streams go from the page cache to the socket, traces and --rate need the bytes in hand.
+    // elsewhere than linux they are read and sent
+    size_t SendFile(int32_t fd, uint64_t offset, size_t length) {
+#ifdef __linux__
+        if(trace || RateLimiter::Shared().Enabled())
+            return Sender::SendFile(fd, offset, length);
+        TimelineSpan span("sendfile", "net", length);
+        off_t pos = offset;
+        size_t sent = 0;
+        while(sent < length) {
+            ssize_t len = sendfile(remote, fd, &pos, length - sent);
+            if(len < 0 && errno == EINTR)
+                continue;
+            if(len <= 0)
+                break;
+            sent += len;
+        }
+        return sent;
+#else
+        return Sender::SendFile(fd, offset, length);
+#endif
+    }
+
+    void BeginWindow() { tuner.BeginWindow(); }
+    void EndWindow(size_t bytes) { tuner.EndWindow(bytes); }
+    void WindowAcked() { tuner.WindowAcked(); }
+    void WindowReleased() { tuner.WindowReleased(); }
+    size_t WindowSize(size_t fallback) { return tuner.window.Window(); }
+
+    TransportTuner tuner;
+    SessionTrace* trace = nullptr;
     
 protected:
     int32_t remote;
@@ -18,10 +99,91 @@ protected:
 
 void show_usage(char* cmd) {
     std::cout << cmd << " [ip] copy [local_file] [remote_file]" << std::endl;
-    std::cout << cmd << " [ip] install [local_vpk]" << std::endl;
+    std::cout << cmd << " [ip] down [remote_file] [local_file]" << std::endl;
+    std::cout << cmd << " [ip] install [local_vpk] [--patch] [--deflate[=level]] [--stream-cache] [--no-headers-first]" << std::endl;
+    std::cout << cmd << " [ip] install-batch [manifest] [--patch] [--deflate[=level]] [--stream-cache] [--no-headers-first]" << std::endl;
+    std::cout << cmd << " [ip] list [remote_dir] [--refresh]" << std::endl;
+    std::cout << cmd << " [ip] sync [local_dir] [remote_dir] [--delete]" << std::endl;
+    std::cout << "options: --net-report  print the transport settings chosen for the link" << std::endl;
+    std::cout << "         --timing      print where startup time went" << std::endl;
+    std::cout << "         --timeout=ms  connect timeout (5000)" << std::endl;
+    std::cout << "         --max-memory=size  cap for transfer buffers, e.g. 16M (no cap)" << std::endl;
+    std::cout << "         --huge-pages  back large buffers with huge pages" << std::endl;
+    std::cout << "         --rate=size   limit uploads to size bytes per second, e.g. 5M" << std::endl;
+    std::cout << "         --window=size fixed upload window between acks, e.g. 2M (adapts 256K-8M)" << std::endl;
+    std::cout << "         --pipeline    read, frame and send on separate threads (copy, install)" << std::endl;
+    std::cout << "         --chrome-trace=file  write a timeline of the session in chrome trace-event json" << std::endl;
+    std::cout << "         --record=file  write a packet trace of the session for vitamock --replay" << std::endl;
 }
 
 int32_t main(int32_t argc, char* argv[]) {
+    // options may appear anywhere, everything else is positional
+    bool refresh = false;
+    bool delete_extras = false;
+    bool patch = false;
+    int32_t deflate_level = 0;
+    bool stream_cache = false;
+    bool headers_first = true;
+    bool net_report = false;
+    bool timing = false;
+    int32_t timeout_ms = 5000;
+    size_t max_memory = 0;
+    bool huge_pages = false;
+    const char* record_file = nullptr;
+    bool pipeline = false;
+    size_t rate = 0;
+    size_t window = 0;
+    const char* chrome_trace = nullptr;
+    std::vector<char*> args;
+    for(int32_t i = 0; i < argc; ++i) {
+        if(strcmp(argv[i], "--refresh") == 0)
+            refresh = true;
+        else if(strcmp(argv[i], "--patch") == 0)
+            patch = true;
+        else if(strcmp(argv[i], "--delete") == 0)
+            delete_extras = true;
+        else if(strcmp(argv[i], "--net-report") == 0)
+            net_report = true;
+        else if(strcmp(argv[i], "--timing") == 0)
+            timing = true;
+        else if(strncmp(argv[i], "--timeout=", 10) == 0)
+            timeout_ms = atoi(argv[i] + 10);
+        else if(strcmp(argv[i], "--deflate") == 0)
+            deflate_level = 1;
+        else if(strncmp(argv[i], "--deflate=", 10) == 0)
+            deflate_level = atoi(argv[i] + 10);
+        else if(strcmp(argv[i], "--stream-cache") == 0)
+            stream_cache = true;
+        else if(strcmp(argv[i], "--no-headers-first") == 0)
+            headers_first = false;
+        else if(strncmp(argv[i], "--max-memory=", 13) == 0)
+            max_memory = parse_size(argv[i] + 13);
+        else if(strcmp(argv[i], "--huge-pages") == 0)
+            huge_pages = true;
+        else if(strncmp(argv[i], "--record=", 9) == 0)
+            record_file = argv[i] + 9;
+        else if(strcmp(argv[i], "--pipeline") == 0)
+            pipeline = true;
+        else if(strncmp(argv[i], "--chrome-trace=", 15) == 0)
+            chrome_trace = argv[i] + 15;
+        else if(strncmp(argv[i], "--rate=", 7) == 0)
+            rate = parse_size(argv[i] + 7);
+        else if(strncmp(argv[i], "--window=", 9) == 0)
+            window = parse_size(argv[i] + 9);
+        else
+            args.push_back(argv[i]);
+    }
+    argc = args.size();
+    argv = args.data();
+    // below one window plus the coroutine stack every transfer would crawl
+    if(max_memory && max_memory < 1024 * 1024)
+        max_memory = 1024 * 1024;
+    BufferPool::Shared().SetLimit(max_memory);
+    BufferPool::Shared().EnableHugePages(huge_pages);
+    if(chrome_trace) {
+        Timeline::Shared().Enable();
+        Timeline::Shared().NameThread("main");
+    }
     if(argc < 3) {
         show_usage(argv[0]);
         return 0;
@@ -36,56 +198,154 @@ int32_t main(int32_t argc, char* argv[]) {
         show_usage(argv[0]);
         return 0;
     }
+    // the connect runs while the handler loads, startup costs the longer of both instead of their sum
+    Connector connector;
+    auto startup_begin = std::chrono::steady_clock::now();
+    double eboot_time = 0.0;
     if(strcmp(argv[2], "copy") == 0) {
         if(argc < 5) {
             show_usage(argv[0]);
             return 0;
         }
+        connector.Start(addr, timeout_ms);
         auto ch = new CopyHandler();
         if(!ch->Load(argv[3], argv[4])) {
             std::cout << "local file " << argv[3] << " load fail." << std::endl;
             delete ch;
             return 0;
         }
+        ch->EnablePipeline(pipeline);
+        RemoteCache::InvalidatePath(argv[1], argv[4]);
         ph = ch;
+    } else if(strcmp(argv[2], "down") == 0) {
+        if(argc < 5) {
+            show_usage(argv[0]);
+            return 0;
+        }
+        connector.Start(addr, timeout_ms);
+        auto dh = new DownHandler();
+        if(!dh->Load(argv[3], argv[4])) {
+            std::cout << "local file " << argv[4] << " create fail." << std::endl;
+            delete dh;
+            return 0;
+        }
+        ph = dh;
     } else if(strcmp(argv[2], "install") == 0) {
         if(argc < 4) {
             show_usage(argv[0]);
             return 0;
         }
+        connector.Start(addr, timeout_ms);
         auto ih = new InstallHandler();
         if(!ih->Load(argv[3])) {
             std::cout << "local vpk " << argv[3] << " load fail." << std::endl;
             delete ih;
             return 0;
         }
+        eboot_time = ih->EbootTime();
+        ih->SetDevice(argv[1], patch);
+        ih->EnablePipeline(pipeline);
+        ih->EnableHeadersFirst(headers_first);
+        if(stream_cache && ih->EnableStreamCache(deflate_level))
+            std::cout << "install stream cached by an earlier install." << std::endl;
+        else if(deflate_level > 0)
+            ih->EnableDeflate(std::thread::hardware_concurrency(), deflate_level);
+        RemoteCache::InvalidatePath(argv[1], "ux0:app");
         ph = ih;
+    } else if(strcmp(argv[2], "install-batch") == 0) {
+        if(argc < 4) {
+            show_usage(argv[0]);
+            return 0;
+        }
+        connector.Start(addr, timeout_ms);
+        auto bh = new BatchInstallHandler();
+        if(!bh->Load(argv[3])) {
+            std::cout << "manifest " << argv[3] << " load fail." << std::endl;
+            delete bh;
+            return 0;
+        }
+        bh->SetOptions(argv[1], patch, pipeline, deflate_level, stream_cache, headers_first);
+        RemoteCache::InvalidatePath(argv[1], "ux0:app");
+        ph = bh;
+    } else if(strcmp(argv[2], "list") == 0) {
+        if(argc < 4) {
+            show_usage(argv[0]);
+            return 0;
+        }
+        auto lh = new ListHandler();
+        if(!lh->Load(argv[1], argv[3])) {
+            delete lh;
+            return 0;
+        }
+        if(!refresh && lh->PrintCached()) {
+            delete lh;
+            return 0;
+        }
+        connector.Start(addr, timeout_ms);
+        ph = lh;
+    } else if(strcmp(argv[2], "sync") == 0) {
+        if(argc < 5) {
+            show_usage(argv[0]);
+            return 0;
+        }
+        auto sh = new SyncHandler();
+        if(!sh->Load(argv[1], argv[3], argv[4])) {
+            std::cout << "local directory " << argv[3] << " load fail." << std::endl;
+            delete sh;
+            return 0;
+        }
+        connector.Start(addr, timeout_ms);
+        sh->SetOptions(delete_extras, pipeline);
+        ph = sh;
     } else {
         show_usage(argv[0]);
         return 0;
     }
     
-    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    int res = connect(sock, (sockaddr*)&addr, sizeof(addr));
-    if(res == 0) {
+    double load_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - startup_begin).count();
+    int sock = connector.Wait();
+    if(timing) {
+        double ready_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - startup_begin).count();
+        std::cout << "startup: connect " << connector.Elapsed() * 1000.0 << " ms, load " << load_time * 1000.0
+            << " ms (eboot " << eboot_time * 1000.0 << " ms concurrent), ready after " << ready_time * 1000.0
+            << " ms, serial up to " << (connector.Elapsed() + load_time) * 1000.0 << " ms (connect + load)" << std::endl;
+    }
+    if(sock < 0)
+        std::cout << "cannot connect to " << argv[1] << "." << std::endl;
+    else {
         char recv_buffer[8192];
         int recv_offset = 0;
         bool quit = false;
         std::cout << "server connected." << std::endl;
         LocalSender sender(sock);
+        sender.tuner.window.SetFixed(window);
+        if(rate)
+            RateLimiter::Shared().SetRate(rate);
+        SessionTrace trace;
+        if(record_file) {
+            if(trace.Create(record_file))
+                sender.trace = &trace;
+            else
+                std::cout << "cannot create " << record_file << ", not recording." << std::endl;
+        }
         pkt_base hdr;
-        // first packet
-        ph->InitSend(sender);
+        // first packet, a handler that cannot send it is done already
+        quit = ph->InitSend(sender) != 0;
         
         // begin recv
         while (!quit) {
-            int recv_size = recv(sock, &recv_buffer[recv_offset], 8192 - recv_offset, 0);
+            int recv_size = 0;
+            {
+                // time spent blocked here is time the device kept us waiting
+                TimelineSpan span("recv", "net");
+                recv_size = recv(sock, &recv_buffer[recv_offset], 8192 - recv_offset, 0);
+            }
             if (recv_size > 0) {
                 recv_offset += recv_size;
                 int offset = 0;
                 while(offset + 4 <= recv_offset) {
                     int left_data_size = recv_offset - offset;  // include header
-                    memcpy(&hdr, &recv_buffer[offset], 4);
+                    hdr = read_header(&recv_buffer[offset]);
                     if(hdr.length < 4 || hdr.length > 1500) {
                         // packet length error, skip
                         offset += 2;
@@ -95,6 +355,8 @@ int32_t main(int32_t argc, char* argv[]) {
                         // need receive more data
                         break;
                     }
+                    if(sender.trace)
+                        sender.trace->Received(hdr.type, &recv_buffer[offset + 4], hdr.length - 4);
                     if(ph->HandlePacket(sender, hdr.type, &recv_buffer[offset + 4], hdr.length - 4)) {
                         quit = true;
                         break;
@@ -110,8 +372,17 @@ int32_t main(int32_t argc, char* argv[]) {
                 break;
             }
         }
+        if(net_report)
+            sender.tuner.Report();
     }
-    close(sock);
+    if(sock >= 0)
+        close(sock);
     delete ph;
+    if(chrome_trace) {
+        if(Timeline::Shared().Write(chrome_trace))
+            std::cout << "timeline written to " << chrome_trace << "." << std::endl;
+        else
+            std::cout << "cannot write " << chrome_trace << "." << std::endl;
+    }
     return 0;
 }
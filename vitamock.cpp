@@ -0,0 +1,577 @@
+// Loopback emulation of the VitaShell-Mod side of the protocol for offline testing.
+// Remote paths map into a local directory: "ux0:app/ABCD00001" -> [root_dir]/ux0/app/ABCD00001
+// Package entries are stored exactly as received (deflated entries stay deflated).
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <zlib.h>
+#include <thread>
+
+#include "common.h"
+#include "session_trace.h"
+
+class MockSender : public Sender {
+public:
+    MockSender(int32_t client) {
+        remote = client;
+    }
+
+    size_t Send(void* data, size_t length) {
+        size_t sent = 0;
+        while(sent < length) {
+            ssize_t res = send(remote, (uint8_t*)data + sent, length - sent, 0);
+            if(res <= 0)
+                return sent;
+            sent += res;
+        }
+        return sent;
+    }
+
+protected:
+    int32_t remote;
+};
+
+inline bool make_dirs(const std::string& path) {
+    for(size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1))
+        mkdir(path.substr(0, pos).c_str(), 0755);
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+// visit all files below dir, rel is the path relative to the first call
+template<typename FUNC>
+inline void walk_tree(const std::string& dir, const std::string& rel, bool recursive, FUNC fun) {
+    DIR* d = opendir(dir.c_str());
+    if(!d)
+        return;
+    while(dirent* ent = readdir(d)) {
+        if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        std::string full = dir + "/" + ent->d_name;
+        std::string name = rel.empty() ? std::string(ent->d_name) : rel + "/" + ent->d_name;
+        struct stat st;
+        if(stat(full.c_str(), &st) != 0)
+            continue;
+        fun(full, name, st);
+        if(recursive && S_ISDIR(st.st_mode))
+            walk_tree(full, name, recursive, fun);
+    }
+    closedir(d);
+}
+
+inline void remove_tree(const std::string& path) {
+    struct stat st;
+    if(lstat(path.c_str(), &st) != 0)
+        return;
+    if(S_ISDIR(st.st_mode)) {
+        std::vector<std::string> children;
+        walk_tree(path, "", false, [&children](const std::string& full, const std::string&, struct stat&) {
+            children.push_back(full);
+        });
+        for(auto& child : children)
+            remove_tree(child);
+        rmdir(path.c_str());
+    } else
+        unlink(path.c_str());
+}
+
+inline bool recv_exact(int32_t sock, void* buf, size_t len) {
+    size_t got = 0;
+    while(got < len) {
+        ssize_t res = recv(sock, (uint8_t*)buf + got, len - got, 0);
+        if(res <= 0)
+            return false;
+        got += res;
+    }
+    return true;
+}
+
+// one packet from the client, false when it closed or sent a broken header
+inline bool recv_packet(int32_t sock, pkt_base& hdr, std::vector<uint8_t>& body) {
+    if(!recv_exact(sock, &hdr, 4))
+        return false;
+    hdr = read_header(&hdr);
+    if(hdr.length < 4)
+        return false;
+    body.resize(hdr.length - 4);
+    return body.empty() || recv_exact(sock, body.data(), body.size());
+}
+
+class MockDevice {
+public:
+    MockDevice(int32_t client, const std::string& root, uint32_t flags) : sender(client) {
+        sock = client;
+        root_dir = root;
+        supported_flags = flags;
+    }
+
+    ~MockDevice() {
+        if(fd >= 0)
+            close(fd);
+    }
+
+    void Run() {
+        pkt_base hdr;
+        std::vector<uint8_t> body;
+        while(ReadPacket(hdr, body)) {
+            if(!HandlePacket(hdr, body))
+                break;
+        }
+    }
+
+protected:
+    bool ReadPacket(pkt_base& hdr, std::vector<uint8_t>& body) {
+        return recv_packet(sock, hdr, body);
+    }
+
+    std::string LocalPath(const std::string& vita_path) {
+        std::string p = vita_path;
+        size_t colon = p.find(':');
+        if(colon != std::string::npos)
+            p = p.substr(0, colon) + "/" + p.substr(colon + 1);
+        while(p.find("//") != std::string::npos)
+            p.replace(p.find("//"), 2, "/");
+        if(p.length() > 1 && p.back() == '/')
+            p.pop_back();
+        return root_dir + "/" + p;
+    }
+
+    static std::string ParentDir(const std::string& path) {
+        size_t pos = path.rfind('/');
+        return pos == std::string::npos ? std::string(".") : path.substr(0, pos);
+    }
+
+    bool HandlePacket(pkt_base& hdr, std::vector<uint8_t>& body) {
+        switch(hdr.type) {
+            case 0x10: {
+                VTP_BEGIN_FILE::View req(body.data(), body.size());
+                std::string vita_path((const char*)req.Tail(), strnlen((const char*)req.Tail(), req.TailSize()));
+                uint64_t size = req.Get<0>();
+                uint32_t size_h = 0;
+                if((req.Get<1>() & 0x2) && (int32_t)vita_path.length() + 5 <= req.TailSize()) {
+                    memcpy(&size_h, req.Tail() + vita_path.length() + 1, 4);
+                    size |= (uint64_t)wire_order(size_h) << 32;
+                }
+                std::string path = LocalPath(vita_path);
+                if(!make_dirs(ParentDir(path))) {
+                    VTRP_BEGIN_FILE::Send(sender, 3, 0, 0);
+                    return false;
+                }
+                fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if(fd < 0) {
+                    VTRP_BEGIN_FILE::Send(sender, 4, 0, 0);
+                    return false;
+                }
+                std::cout << "copy " << vita_path << " (" << size << " bytes)" << std::endl;
+                VTRP_BEGIN_FILE::Send(sender, 0, 0, 0);
+                break;
+            }
+            case 0x11: {
+                if(body.empty())
+                    VTP_FILE_CONTENT::Send(sender);
+                else if(write(fd, body.data(), body.size()) != (ssize_t)body.size())
+                    return false;
+                break;
+            }
+            case 0x12: {
+                close(fd);
+                fd = -1;
+                VTRP_FILE_END::Send(sender, 0);
+                break;
+            }
+            case 0x13: {
+                return DownFile((const char*)body.data());
+            }
+            case 0x20: {
+                VTP_INSTALL_VPK::View req(body.data(), body.size());
+                // flags the device does not know are dropped from the echo, like stock firmware
+                install_flag = req.Get<2>() & (supported_flags | 0xf);
+                pkg_dir = LocalPath("ux0:ptmp/pkg");
+                remove_tree(pkg_dir);
+                make_dirs(pkg_dir);
+                removed_entries.clear();
+                record_head.clear();
+                entry_left = 0;
+                aborted = false;
+                std::cout << "install " << (((uint64_t)req.Get<1>() << 32) | req.Get<0>()) << " bytes, flag 0x" << std::hex << install_flag << std::dec << std::endl;
+                VTRP_INSTALL_VPK::Send(sender, 0, install_flag & 0xf0);
+                break;
+            }
+            // after an early abort whatever the client still had in flight is dropped
+            case 0x14: {
+                if(!aborted)
+                    VTP_VPK_CONTENT::Send(sender);
+                break;
+            }
+            case 0x21: {
+                return aborted || VpkContent(body.data(), body.size());
+            }
+            // the end after an early abort is where the client is back in step, it gets the abort result
+            case 0x22: {
+                VTRP_INSTALL_VPK_END::Send(sender, aborted ? 1 : Promote());
+                aborted = false;
+                break;
+            }
+            case 0x30: {
+                VTP_LIST_DIR::View req(body.data(), body.size());
+                return ListDir(std::string((const char*)req.Tail(), strnlen((const char*)req.Tail(), req.TailSize())), req.Get<0>() & 0x1);
+            }
+            case 0x40: {
+                std::string vita_path((const char*)body.data(), strnlen((const char*)body.data(), body.size()));
+                std::string path = LocalPath(vita_path);
+                struct stat st;
+                if(lstat(path.c_str(), &st) != 0) {
+                    VTRP_REMOVE_PATH::Send(sender, 4);
+                    break;
+                }
+                remove_tree(path);
+                std::cout << "remove " << vita_path << std::endl;
+                VTRP_REMOVE_PATH::Send(sender, 0);
+                break;
+            }
+        }
+        return true;
+    }
+
+    bool DownFile(const std::string& vita_path) {
+        static const int32_t send_threshold = 2 * 1024 * 1024;
+        int32_t in = open(LocalPath(vita_path).c_str(), O_RDONLY);
+        struct stat st;
+        if(in < 0 || fstat(in, &st) != 0) {
+            VTRP_DOWN_FILE::Send(sender, 4, 0);
+            return false;
+        }
+        std::cout << "down " << vita_path << " (" << st.st_size << " bytes)" << std::endl;
+        VTRP_DOWN_FILE::Send(sender, 0, st.st_size);
+        uint8_t buf[1028];
+        int32_t bytes_sum = 0;
+        ssize_t bytes_read = 0;
+        while((bytes_read = read(in, &buf[4], 1024)) > 0) {
+            VTP_DOWN_CONTINE::Encode(buf, bytes_read);
+            sender.Send(buf, 4 + bytes_read);
+            bytes_sum += bytes_read;
+            if(bytes_sum >= send_threshold) {
+                bytes_sum = 0;
+                VTP_DOWN_CONTINE::Send(sender);
+                pkt_base ack;
+                std::vector<uint8_t> body;
+                do {
+                    if(!ReadPacket(ack, body)) {
+                        close(in);
+                        return false;
+                    }
+                } while(ack.type != 0x14);
+            }
+        }
+        close(in);
+        VTP_DOWN_END::Send(sender);
+        return true;
+    }
+
+    bool ListDir(const std::string& vita_path, bool recursive) {
+        std::string dir = LocalPath(vita_path);
+        struct stat st;
+        if(stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            // the session goes on, sync lists a directory before creating it
+            VTRP_LIST_DIR::Send(sender, 4);
+            return true;
+        }
+        VTRP_LIST_DIR::Send(sender, 0);
+        std::vector<uint8_t> out;
+        auto flush = [this, &out](size_t keep) {
+            while(out.size() > keep) {
+                size_t len = out.size() < 1024 ? out.size() : 1024;
+                VTP_LIST_CONTENT::SendTail(sender, out.data(), len);
+                out.erase(out.begin(), out.begin() + len);
+            }
+        };
+        walk_tree(dir, "", recursive, [&out, &flush](const std::string&, const std::string& name, struct stat& st) {
+            VTP_LIST_ENTRY le;
+            uint64_t size = S_ISDIR(st.st_mode) ? 0 : st.st_size;
+            le.name_size = wire_order((uint16_t)name.length());
+            le.attr = wire_order((uint16_t)(S_ISDIR(st.st_mode) ? 0x1 : 0));
+            le.size_l = wire_order((uint32_t)(size & 0xffffffff));
+            le.size_h = wire_order((uint32_t)(size >> 32));
+            le.mtime = wire_order((uint32_t)st.st_mtime);
+            out.insert(out.end(), (uint8_t*)&le, (uint8_t*)&le + sizeof(le));
+            out.insert(out.end(), name.begin(), name.end());
+            flush(1024);
+        });
+        flush(0);
+        VTP_LIST_END::Send(sender);
+        return true;
+    }
+
+    // entry records may span packets: nlen, path, csize, data
+    bool VpkContent(uint8_t* data, size_t len) {
+        while(len) {
+            if(entry_left > 0) {
+                size_t chunk = len < entry_left ? len : entry_left;
+                if(!WriteEntry(data, chunk))
+                    return false;
+                data += chunk;
+                len -= chunk;
+                entry_left -= chunk;
+                if(entry_left == 0 && !EndEntry())
+                    return true;
+                continue;
+            }
+            record_head.push_back(*data++);
+            len--;
+            if(record_head.size() < 2)
+                continue;
+            uint16_t nlen_raw = 0;
+            memcpy(&nlen_raw, record_head.data(), 2);
+            nlen_raw = wire_order(nlen_raw);
+            uint16_t nlen = nlen_raw & 0x7fff;
+            if(record_head.size() < 2u + nlen + 4)
+                continue;
+            std::string name((const char*)&record_head[2], nlen);
+            int32_t csize = 0;
+            memcpy(&csize, &record_head[2 + nlen], 4);
+            csize = wire_order(csize);
+            entry_deflated = (nlen_raw & 0x8000) != 0;
+            record_head.clear();
+            if(name.compare(0, 13, "ux0:ptmp/pkg/") == 0)
+                name = name.substr(13);
+            if(csize < 0) {
+                removed_entries.push_back(name);
+                continue;
+            }
+            entry_name = name;
+            std::string path = pkg_dir + "/" + name;
+            make_dirs(ParentDir(path));
+            fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(fd < 0)
+                return false;
+            entry_left = csize;
+            if(entry_deflated) {
+                memset(&entry_stream, 0, sizeof(entry_stream));
+                inflateInit2(&entry_stream, -15);
+            }
+            if(entry_left == 0 && !EndEntry())
+                return true;
+        }
+        return true;
+    }
+
+    // entries deflated by the client are restored to their stored form
+    bool WriteEntry(uint8_t* data, size_t len) {
+        if(!entry_deflated)
+            return write(fd, data, len) == (ssize_t)len;
+        uint8_t out[0x10000];
+        entry_stream.next_in = data;
+        entry_stream.avail_in = len;
+        do {
+            entry_stream.next_out = out;
+            entry_stream.avail_out = sizeof(out);
+            int32_t res = inflate(&entry_stream, Z_NO_FLUSH);
+            if(res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR)
+                return false;
+            size_t produced = sizeof(out) - entry_stream.avail_out;
+            if(write(fd, out, produced) != (ssize_t)produced)
+                return false;
+        } while(entry_stream.avail_out == 0);
+        return true;
+    }
+
+    // with flag 0x40 the headers come first and are checked as soon as they are complete,
+    // false when the install was aborted
+    bool EndEntry() {
+        if(entry_deflated)
+            inflateEnd(&entry_stream);
+        entry_deflated = false;
+        close(fd);
+        fd = -1;
+        if(!(install_flag & 0x40) || entry_name != "sce_sys/param.sfo" || !ReadTitleId().empty())
+            return true;
+        std::cout << "install aborted, bad param.sfo" << std::endl;
+        VTRP_INSTALL_VPK_ABORT::Send(sender, 1);
+        remove_tree(pkg_dir);
+        aborted = true;
+        return false;
+    }
+
+    std::string ReadTitleId() {
+        std::ifstream f(pkg_dir + "/sce_sys/param.sfo", std::ios::in | std::ios::binary);
+        std::vector<uint8_t> sfo((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        if(sfo.size() >= 4 && memcmp(sfo.data(), "\0PSF", 4) != 0) {
+            // stored deflated
+            std::vector<uint8_t> raw(0x10000);
+            z_stream estr;
+            memset(&estr, 0, sizeof(estr));
+            inflateInit2(&estr, -15);
+            estr.next_in = sfo.data();
+            estr.avail_in = sfo.size();
+            estr.next_out = raw.data();
+            estr.avail_out = raw.size();
+            inflate(&estr, Z_FINISH);
+            raw.resize(raw.size() - estr.avail_out);
+            inflateEnd(&estr);
+            sfo.swap(raw);
+        }
+        return sfo_title_id(sfo);
+    }
+
+    // 0-success 1-makeHeadBin() error 2-promote() error
+    int32_t Promote() {
+        std::string title_id = ReadTitleId();
+        if(title_id.empty())
+            return 1;
+        std::string app_dir = LocalPath("ux0:app/" + title_id);
+        if(!(install_flag & 0x10)) {
+            remove_tree(app_dir);
+            make_dirs(ParentDir(app_dir));
+            if(rename(pkg_dir.c_str(), app_dir.c_str()) != 0)
+                return 2;
+        } else {
+            int32_t result = 0;
+            walk_tree(pkg_dir, "", true, [this, &app_dir, &result](const std::string& full, const std::string& name, struct stat& st) {
+                if(S_ISDIR(st.st_mode))
+                    return;
+                std::string dst = app_dir + "/" + name;
+                make_dirs(ParentDir(dst));
+                if(rename(full.c_str(), dst.c_str()) != 0)
+                    result = 2;
+            });
+            for(auto& name : removed_entries)
+                unlink((app_dir + "/" + name).c_str());
+            remove_tree(pkg_dir);
+            if(result)
+                return result;
+        }
+        std::cout << "installed " << title_id << (install_flag & 0x10 ? " (patch, " : " (") << removed_entries.size() << " removed)" << std::endl;
+        return 0;
+    }
+
+    int32_t sock;
+    MockSender sender;
+    std::string root_dir;
+    int32_t fd = -1;
+    uint32_t install_flag = 0;
+    uint32_t supported_flags = 0x70;
+    std::string pkg_dir;
+    std::vector<uint8_t> record_head;
+    size_t entry_left = 0;
+    bool entry_deflated = false;
+    std::string entry_name;
+    bool aborted = false;
+    z_stream entry_stream;
+    std::vector<std::string> removed_entries;
+};
+
+// plays the device side of a recorded session back with its original timing.
+// device packets keep their distance to the client packet before them, so a faster or slower
+// client shifts the schedule instead of being measured against the recorded clock
+class TraceReplay {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    TraceReplay(int32_t client, const std::vector<SessionTrace::Record>& recs) : sender(client), records(recs) {
+        sock = client;
+    }
+
+    void Run() {
+        auto begin = clock::now();
+        auto anchor_now = begin;
+        uint64_t anchor_us = 0;
+        size_t diverged = 0;
+        pkt_base hdr;
+        std::vector<uint8_t> body;
+        for(size_t i = 0; i < records.size(); ++i) {
+            auto& rec = records[i];
+            if(rec.dir == SessionTrace::dir_client) {
+                Flush();
+                if(!ReadPacket(hdr, body)) {
+                    std::cout << "client closed at record " << i << "/" << records.size() << std::endl;
+                    return;
+                }
+                if(hdr.type != rec.type && diverged++ == 0)
+                    std::cout << "diverged at record " << i << ": expected type 0x" << std::hex << rec.type
+                        << ", got 0x" << hdr.type << std::dec << std::endl;
+                anchor_now = clock::now();
+                anchor_us = rec.time_us;
+                continue;
+            }
+            auto due = anchor_now + std::chrono::microseconds(rec.time_us - anchor_us);
+            if(due > clock::now()) {
+                Flush();
+                std::this_thread::sleep_until(due);
+            }
+            size_t pos = out_buffer.size();
+            out_buffer.resize(pos + rec.length);
+            pkt_base ph = wire_header(rec.length, rec.type);
+            memcpy(&out_buffer[pos], &ph, 4);
+            if(rec.payload.size())
+                memcpy(&out_buffer[pos + 4], rec.payload.data(), rec.payload.size());
+            else
+                memset(&out_buffer[pos + 4], 0, rec.length - 4);
+        }
+        Flush();
+        double took = std::chrono::duration<double>(clock::now() - begin).count();
+        double recorded = records.empty() ? 0.0 : records.back().time_us / 1000000.0;
+        std::cout << "replayed " << records.size() << " packets in " << took << " s (recorded " << recorded << " s"
+            << (diverged ? ", " + std::to_string(diverged) + " diverged" : std::string()) << ")" << std::endl;
+    }
+
+protected:
+    bool ReadPacket(pkt_base& hdr, std::vector<uint8_t>& body) {
+        return recv_packet(sock, hdr, body);
+    }
+
+    // packets that are already due go out in one write
+    void Flush() {
+        if(out_buffer.size())
+            sender.Send(out_buffer.data(), out_buffer.size());
+        out_buffer.clear();
+    }
+
+    int32_t sock;
+    MockSender sender;
+    const std::vector<SessionTrace::Record>& records;
+    std::vector<uint8_t> out_buffer;
+};
+
+int32_t main(int32_t argc, char* argv[]) {
+    if(argc < 2) {
+        std::cout << argv[0] << " [root_dir] [port] [install_flags]" << std::endl;
+        std::cout << argv[0] << " --replay=trace [port]" << std::endl;
+        return 0;
+    }
+    std::vector<SessionTrace::Record> records;
+    bool replay = strncmp(argv[1], "--replay=", 9) == 0;
+    if(replay && !SessionTrace::Load(argv[1] + 9, records)) {
+        std::cout << "cannot load trace " << argv[1] + 9 << "." << std::endl;
+        return 1;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(argc > 2 ? atoi(argv[2]) : 1340);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if(bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 4) != 0) {
+        std::cout << "cannot listen on port " << ntohs(addr.sin_port) << "." << std::endl;
+        close(sock);
+        return 1;
+    }
+    std::cout << (replay ? "replay" : "mock device") << " listening on 127.0.0.1:" << ntohs(addr.sin_port) << std::endl;
+    while(true) {
+        int client = accept(sock, nullptr, nullptr);
+        if(client < 0)
+            break;
+        if(replay) {
+            TraceReplay rp(client, records);
+            rp.Run();
+        } else {
+            MockDevice dev(client, argv[1], argc > 3 ? strtoul(argv[3], nullptr, 0) : 0x70);
+            dev.Run();
+        }
+        close(client);
+    }
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,199 @@
+#ifndef _ZIP_ENTRY_TABLE_H_
+#define _ZIP_ENTRY_TABLE_H_
+
+#include <algorithm>
+#include <numeric>
+
+#include "common.h"
+
+struct ZipFileInfo {
+    bool compressed = false;
+    size_t data_offset = 0; // local header
+    size_t data_start = 0;  // data after local header
+    size_t comp_size = 0;
+    size_t file_size = 0;
+    uint32_t crc32 = 0;
+    int32_t deflate_job = -1;   // stored entry recompressed by the deflate pool
+};
+
+// a name in the entry table's arena, valid until the table changes. the send path reads names
+// through it so checking and framing an entry copies nothing
+struct EntryName {
+    const char* data = nullptr;
+    size_t length = 0;
+
+    bool operator==(const char* str) const {
+        return strlen(str) == length && memcmp(data, str, length) == 0;
+    }
+
+    std::string Str() const {
+        return std::string(data, length);
+    }
+};
+
+inline std::ostream& operator<<(std::ostream& os, const EntryName& name) {
+    return os.write(name.data, name.length);
+}
+
+// identifies a vpk for the files derived from it in ~/.vitamgr
+struct ZipIndexKey {
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime = 0;  // nanoseconds
+    uint64_t inode = 0;
+};
+
+// the entries of a vpk as columns, sorted by name after Finish.
+// all names live in one arena addressed by offset, so a vpk with 100k entries costs
+// a handful of allocations instead of two per entry, and a pass over one field stays in cache
+class ZipEntryTable {
+public:
+    static const size_t npos = (size_t)-1;
+
+    void Clear() {
+        names.clear();
+        name_pos.clear();
+        name_len.clear();
+        compressed.clear();
+        data_offset.clear();
+        data_start.clear();
+        comp_size.clear();
+        file_size.clear();
+        crc32.clear();
+        deflate_job.clear();
+    }
+
+    // both are hints, the table grows past them
+    void Reserve(size_t count, size_t name_bytes) {
+        names.reserve(name_bytes);
+        name_pos.reserve(count);
+        name_len.reserve(count);
+        compressed.reserve(count);
+        data_offset.reserve(count);
+        data_start.reserve(count);
+        comp_size.reserve(count);
+        file_size.reserve(count);
+        crc32.reserve(count);
+        deflate_job.reserve(count);
+    }
+
+    // appends an entry with zeroed fields, returns its index until the next Finish
+    size_t Add(const char* name, size_t len) {
+        name_pos.push_back(names.size());
+        name_len.push_back(len);
+        names.insert(names.end(), name, name + len);
+        compressed.push_back(0);
+        data_offset.push_back(0);
+        data_start.push_back(0);
+        comp_size.push_back(0);
+        file_size.push_back(0);
+        crc32.push_back(0);
+        deflate_job.push_back(-1);
+        return name_pos.size() - 1;
+    }
+
+    // sorts the rows by name, a name added twice keeps its last row
+    void Finish() {
+        std::vector<uint32_t> order(Size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+            int32_t res = Compare(a, names.data() + name_pos[b], name_len[b]);
+            return res < 0 || (res == 0 && a < b);
+        });
+        size_t count = 0;
+        for(size_t i = 0; i < order.size(); ++i) {
+            if(i + 1 < order.size() && Compare(order[i], names.data() + name_pos[order[i + 1]], name_len[order[i + 1]]) == 0)
+                continue;
+            order[count++] = order[i];
+        }
+        order.resize(count);
+        Permute(name_pos, order);
+        Permute(name_len, order);
+        Permute(compressed, order);
+        Permute(data_offset, order);
+        Permute(data_start, order);
+        Permute(comp_size, order);
+        Permute(file_size, order);
+        Permute(crc32, order);
+        Permute(deflate_job, order);
+    }
+
+    size_t Size() const {
+        return name_pos.size();
+    }
+
+    bool Empty() const {
+        return name_pos.empty();
+    }
+
+    std::string Name(size_t idx) const {
+        return std::string(names.data() + name_pos[idx], name_len[idx]);
+    }
+
+    EntryName NameRef(size_t idx) const {
+        EntryName name;
+        name.data = names.data() + name_pos[idx];
+        name.length = name_len[idx];
+        return name;
+    }
+
+    // binary search, only valid after Finish
+    size_t Find(const std::string& name) const {
+        size_t lo = 0, hi = Size();
+        while(lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            int32_t res = Compare(mid, name.c_str(), name.length());
+            if(res == 0)
+                return mid;
+            if(res < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return npos;
+    }
+
+    // a copy of one row, for code that reads an entry off the table's thread
+    ZipFileInfo Info(size_t idx) const {
+        ZipFileInfo info;
+        info.compressed = compressed[idx];
+        info.data_offset = data_offset[idx];
+        info.data_start = data_start[idx];
+        info.comp_size = comp_size[idx];
+        info.file_size = file_size[idx];
+        info.crc32 = crc32[idx];
+        info.deflate_job = deflate_job[idx];
+        return info;
+    }
+
+    std::vector<uint8_t> compressed;
+    std::vector<uint64_t> data_offset; // local header
+    std::vector<uint64_t> data_start;  // data after local header
+    std::vector<uint64_t> comp_size;
+    std::vector<uint64_t> file_size;
+    std::vector<uint32_t> crc32;
+    std::vector<int32_t> deflate_job;  // stored entry recompressed by the deflate pool
+
+protected:
+    int32_t Compare(size_t idx, const char* name, size_t len) const {
+        size_t common = std::min<size_t>(name_len[idx], len);
+        int32_t res = common ? memcmp(names.data() + name_pos[idx], name, common) : 0;
+        if(res != 0)
+            return res;
+        return name_len[idx] < len ? -1 : (name_len[idx] > len ? 1 : 0);
+    }
+
+    template<typename T>
+    static void Permute(std::vector<T>& column, const std::vector<uint32_t>& order) {
+        std::vector<T> sorted(order.size());
+        for(size_t i = 0; i < order.size(); ++i)
+            sorted[i] = column[order[i]];
+        column.swap(sorted);
+    }
+
+    std::vector<char> names;
+    std::vector<uint32_t> name_pos;
+    std::vector<uint16_t> name_len;
+};
+
+#endif